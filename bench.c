@@ -0,0 +1,456 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * hiro-bench: open a number of subscribers on a hirod, publish to
+ * them at a fixed rate and measure how long every message takes to
+ * be delivered.  Every payload starts with the time it was sent.
+ */
+
+#include "cmd.h"
+#include "hist.h"
+#include "util.h"
+
+#include "err.h"
+#include "strtonum.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <event.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* how often the publisher wakes up */
+#define TICK_USEC	1000
+
+/* time given to the subscribers to get the last messages */
+#define DRAIN_SEC	1
+
+struct sub {
+	int		 fd;
+	int		 ready;
+	struct event	 ev;
+	struct cmdbuf	 in;
+};
+
+struct pub {
+	int		 fd;
+	struct event	 rev;
+	struct event	 wev;
+	struct event	 tick;
+	struct cmdbuf	 in;
+	struct cmdbuf	 out;
+	uint64_t	 start;
+	uint64_t	 sent;
+	uint64_t	 stalls;
+	uint64_t	 errors;
+};
+
+const char	*sockpath;
+const char	*topic = "bench";
+int		 nsubs = 10;
+int		 rate = 10000;
+int		 batchmax = 256;
+int		 duration = 5;
+size_t		 paysize = 64;
+
+struct sub	*subs;
+int		 nready;
+struct pub	 pub;
+struct hist	 lat;
+uint64_t	 received;
+char		*payload;
+
+static void
+usage(const char *me)
+{
+	fprintf(stderr, "USAGE: %s [-b batch] [-d secs] [-n subs] "
+	    "[-P sock_path] [-r rate]\n"
+	    "          [-s size] [-t topic] [-x hirod]\n", me);
+	exit(1);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+open_ctl_sock(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* fork and exec hirod on sockpath and wait for it to be ready */
+static pid_t
+start_hirod(const char *path)
+{
+	pid_t pid;
+	int i, fd;
+
+	switch (pid = fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		execl(path, path, "-P", sockpath, (char *)NULL);
+		err(1, "exec %s", path);
+	}
+
+	for (i = 0; i < 100; ++i) {
+		if ((fd = open_ctl_sock(sockpath)) != -1) {
+			close(fd);
+			return pid;
+		}
+		usleep(10000);
+	}
+
+	kill(pid, SIGTERM);
+	errx(1, "%s didn't start", path);
+}
+
+static void
+handle_sub_read(int fd, short ev, void *d)
+{
+	struct sub *s = d;
+	struct cmd r;
+	uint64_t now, ts;
+	ssize_t n;
+	char *p, *nl, *end;
+
+	if ((n = cmdbuf_read(fd, &s->in)) == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		err(1, "read");
+	}
+	if (n == 0)
+		errx(1, "subscriber connection closed by hirod");
+
+	if (!s->ready) {
+		switch (recv_cmd(&s->in, &r)) {
+		case 0:
+			return;
+		case -1:
+			errx(1, "malformed RECV reply");
+		}
+		if (r.type != CMD_OK)
+			errx(1, "RECV failed");
+		s->ready = 1;
+		nready++;
+	}
+
+	p = s->in.data + s->in.off;
+	end = s->in.data + s->in.len;
+
+	now = now_ns();
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		ts = strtoull(p, NULL, 10);
+		if (ts != 0 && ts <= now)
+			hist_add(&lat, now - ts);
+		received++;
+		p = nl + 1;
+	}
+
+	s->in.off = p - s->in.data;
+}
+
+static void
+pub_flush(struct pub *p)
+{
+	ssize_t r;
+
+	if (p->out.off != p->out.len) {
+		r = cmdbuf_write(p->fd, &p->out);
+		if (r == -1 && errno != EAGAIN && errno != EINTR)
+			err(1, "write");
+	}
+
+	if (p->out.off != p->out.len)
+		event_add(&p->wev, NULL);
+	else
+		event_del(&p->wev);
+}
+
+static void
+handle_pub_write(int fd, short ev, void *d)
+{
+	pub_flush(d);
+}
+
+static void
+handle_pub_read(int fd, short ev, void *d)
+{
+	struct pub *p = d;
+	struct cmd r;
+	ssize_t n;
+
+	if ((n = cmdbuf_read(fd, &p->in)) == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		err(1, "read");
+	}
+	if (n == 0)
+		errx(1, "publisher connection closed by hirod");
+
+	while (recv_cmd(&p->in, &r) == 1) {
+		if (r.type != CMD_OK)
+			p->errors++;
+	}
+}
+
+/* send all the messages due since the start, in SEND_BATCH frames */
+static void
+handle_tick(int fd, short ev, void *d)
+{
+	static char data[CMD_MAXLEN];
+	struct pub *p = d;
+	struct timeval tv;
+	struct cmd cmd;
+	uint64_t now, due;
+	size_t tolen;
+	int n;
+
+	now = now_ns();
+	if (now - p->start >= (uint64_t)duration * 1000000000) {
+		tv.tv_sec = DRAIN_SEC;
+		tv.tv_usec = 0;
+		event_loopexit(&tv);
+		return;
+	}
+
+	tolen = strlen(topic) + 1;
+	if (rate != 0)
+		due = (now - p->start) * rate / 1000000000;
+	else
+		due = p->sent + sizeof(p->out.data) / (tolen + paysize + 1);
+
+	while (p->sent < due) {
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.type = CMD_SEND_BATCH;
+		cmd.data = data;
+
+		for (n = 0; n < batchmax && p->sent < due; ++n) {
+			if (cmd.len + tolen + paysize + 1 > sizeof(data))
+				break;
+			memcpy(data + cmd.len, topic, tolen);
+			cmd.len += tolen;
+			snprintf(payload, paysize + 1, "%020" PRIu64, now_ns());
+			payload[20] = paysize > 20 ? ' ' : '\0';
+			memcpy(data + cmd.len, payload, paysize + 1);
+			cmd.len += paysize + 1;
+			cmd.argc += 2;
+			p->sent++;
+		}
+
+		if (cmd_encode(&p->out, &cmd) == -1) {
+			/* hirod is behind, try again on the next tick */
+			p->sent -= cmd.argc / 2;
+			if (rate != 0)
+				p->stalls++;
+			break;
+		}
+	}
+
+	pub_flush(p);
+
+	tv.tv_sec = 0;
+	tv.tv_usec = TICK_USEC;
+	evtimer_add(&p->tick, &tv);
+}
+
+static void
+start_pub(void)
+{
+	struct timeval tv = { 0, TICK_USEC };
+
+	if ((pub.fd = open_ctl_sock(sockpath)) == -1)
+		err(1, "connect %s", sockpath);
+	if (mark_nonblock(pub.fd) == -1)
+		err(1, "mark_nonblock");
+
+	pub.start = now_ns();
+	event_set(&pub.rev, pub.fd, EV_READ | EV_PERSIST, handle_pub_read,
+	    &pub);
+	event_set(&pub.wev, pub.fd, EV_WRITE | EV_PERSIST, handle_pub_write,
+	    &pub);
+	evtimer_set(&pub.tick, handle_tick, &pub);
+	event_add(&pub.rev, NULL);
+	evtimer_add(&pub.tick, &tv);
+}
+
+static void
+handle_wait_subs(int fd, short ev, void *d)
+{
+	struct timeval tv = { 0, TICK_USEC };
+
+	if (nready != nsubs) {
+		evtimer_add((struct event *)d, &tv);
+		return;
+	}
+
+	start_pub();
+}
+
+static void
+report(void)
+{
+	double secs;
+
+	secs = (double)duration;
+	printf("subscribers:  %d\n", nsubs);
+	printf("payload:      %zu bytes\n", paysize);
+	printf("sent:         %" PRIu64 " msgs (%.0f msgs/s)\n",
+	    pub.sent, pub.sent / secs);
+	printf("delivered:    %" PRIu64 " msgs (%.0f msgs/s, %.1f%%)\n",
+	    received, received / secs,
+	    pub.sent == 0 ? 0.0 : 100.0 * received / ((double)pub.sent * nsubs));
+	printf("stalls:       %" PRIu64 "\n", pub.stalls);
+	printf("errors:       %" PRIu64 "\n", pub.errors);
+	printf("latency (us): p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+	    hist_quantile(&lat, .5) / 1e3, hist_quantile(&lat, .99) / 1e3,
+	    hist_quantile(&lat, .999) / 1e3, lat.max / 1e3);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event wait;
+	struct timeval tv = { 0, TICK_USEC };
+	struct cmd cmd;
+	const char *errstr, *hirod = NULL;
+	pid_t pid = -1;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "b:d:n:P:r:s:t:x:")) != -1) {
+		switch (ch) {
+		case 'b':
+			batchmax = strtonum(optarg, 1, CMD_MAXLEN / 2, &errstr);
+			if (errstr != NULL)
+				errx(1, "batch size is %s: %s", errstr, optarg);
+			break;
+		case 'd':
+			duration = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(1, "duration is %s: %s", errstr, optarg);
+			break;
+		case 'n':
+			nsubs = strtonum(optarg, 1, 100000, &errstr);
+			if (errstr != NULL)
+				errx(1, "subscribers are %s: %s", errstr, optarg);
+			break;
+		case 'P':
+			sockpath = optarg;
+			break;
+		case 'r':
+			rate = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "rate is %s: %s", errstr, optarg);
+			break;
+		case 's':
+			paysize = strtonum(optarg, 20, CMD_MAXLEN / 2, &errstr);
+			if (errstr != NULL)
+				errx(1, "payload size is %s: %s", errstr, optarg);
+			break;
+		case 't':
+			topic = optarg;
+			break;
+		case 'x':
+			hirod = optarg;
+			break;
+		default:
+			usage(*argv);
+		}
+	}
+	if (argc != optind)
+		usage(*argv);
+
+	if (sockpath == NULL)
+		sockpath = default_socket_path();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((payload = malloc(paysize + 1)) == NULL)
+		err(1, "malloc");
+	memset(payload, 'x', paysize);
+	payload[paysize] = '\0';
+
+	if (hirod != NULL)
+		pid = start_hirod(hirod);
+
+	if ((subs = calloc(nsubs, sizeof(*subs))) == NULL)
+		err(1, "calloc");
+
+	event_init();
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = CMD_RECV;
+	cmd.argc = 1;
+	cmd.argv[0] = (char *)topic;
+
+	for (i = 0; i < nsubs; ++i) {
+		if ((subs[i].fd = open_ctl_sock(sockpath)) == -1)
+			err(1, "connect %s", sockpath);
+		if (send_cmd(subs[i].fd, &cmd) == -1)
+			err(1, "send_cmd");
+		if (mark_nonblock(subs[i].fd) == -1)
+			err(1, "mark_nonblock");
+		event_set(&subs[i].ev, subs[i].fd, EV_READ | EV_PERSIST,
+		    handle_sub_read, &subs[i]);
+		event_add(&subs[i].ev, NULL);
+	}
+
+	evtimer_set(&wait, handle_wait_subs, &wait);
+	evtimer_add(&wait, &tv);
+
+	event_dispatch();
+
+	report();
+
+	if (pid != -1) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+
+	return 0;
+}
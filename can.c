@@ -15,56 +15,473 @@
  */
 
 #include "can.h"
-#include "log.h"
 
 #include "arc4random.h"
 
-#include <sys/types.h>
-#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
 
-#include <netinet/in.h>
+void
+random_point(uint64_t *p)
+{
+	arc4random_buf(p, CAN_DIMS * sizeof(*p));
+}
 
-#include <netdb.h>
-#include <string.h>
-#include <unistd.h>
+/*
+ * Zone geometry.  Lengths are compared as len - 1 so that 0, the
+ * whole axis, is the biggest one.
+ */
+
+int
+zone_contains(const struct zone *z, const uint64_t *p)
+{
+	int i;
+
+	for (i = 0; i < CAN_DIMS; ++i)
+		if (p[i] - z->lo[i] > z->len[i] - 1)
+			return 0;
+	return 1;
+}
+
+/* zones are dyadic boxes: along an axis they're nested or disjoint */
+static inline int
+overlaps(uint64_t alo, uint64_t alen, uint64_t blo, uint64_t blen)
+{
+	return blo - alo <= alen - 1 || alo - blo <= blen - 1;
+}
+
+static inline int
+abuts(uint64_t alo, uint64_t alen, uint64_t blo, uint64_t blen)
+{
+	return alo + alen == blo || blo + blen == alo;
+}
+
+/*
+ * Two zones are neighbors if they overlap along all the axes but
+ * one, where they abut (possibly across the edge of the torus).
+ */
+int
+zone_adjacent(const struct zone *a, const struct zone *b)
+{
+	int i, abut = 0;
+
+	for (i = 0; i < CAN_DIMS; ++i) {
+		if (overlaps(a->lo[i], a->len[i], b->lo[i], b->len[i]))
+			continue;
+		if (!abuts(a->lo[i], a->len[i], b->lo[i], b->len[i]) ||
+		    abut++ != 0)
+			return 0;
+	}
+	return abut == 1;
+}
+
+/*
+ * The axis along which b is adjacent to a, or -1 if they aren't
+ * neighbors.  side is 1 if b comes after a along it, -1 if before.
+ */
+int
+zone_side(const struct zone *a, const struct zone *b, int *side)
+{
+	int i, axis = -1;
+
+	for (i = 0; i < CAN_DIMS; ++i) {
+		if (overlaps(a->lo[i], a->len[i], b->lo[i], b->len[i]))
+			continue;
+		if (!abuts(a->lo[i], a->len[i], b->lo[i], b->len[i]) ||
+		    axis != -1)
+			return -1;
+		axis = i;
+	}
+
+	if (axis != -1)
+		*side = a->lo[axis] + a->len[axis] == b->lo[axis] ? 1 : -1;
+	return axis;
+}
+
+/* log2 of the volume of the zone */
+int
+zone_volume(const struct zone *z)
+{
+	int i, v = 0;
+
+	for (i = 0; i < CAN_DIMS; ++i)
+		v += z->len[i] == 0 ? 64 : __builtin_ctzll(z->len[i]);
+	return v;
+}
+
+static inline int
+zone_equal(const struct zone *a, const struct zone *b)
+{
+	return !memcmp(a, b, sizeof(*a));
+}
+
+/* zones are split along the longest axis, the first one on ties */
+static int
+split_axis(const struct zone *z)
+{
+	int i, k = 0;
+
+	for (i = 1; i < CAN_DIMS; ++i)
+		if (z->len[i] - 1 > z->len[k] - 1)
+			k = i;
+	return k;
+}
+
+/* hence the last split was along the shortest axis, the last on ties */
+static int
+last_split_axis(const struct zone *z)
+{
+	int i, k = 0;
+
+	for (i = 1; i < CAN_DIMS; ++i)
+		if (z->len[i] - 1 <= z->len[k] - 1)
+			k = i;
+	return k;
+}
+
+/*
+ * The other half of the zone z was split from.  Returns -1 if z is
+ * the whole space.
+ */
+int
+zone_sibling(const struct zone *z, struct zone *sib)
+{
+	int k;
+
+	k = last_split_axis(z);
+	if (z->len[k] == 0)
+		return -1;
+
+	*sib = *z;
+	sib->lo[k] ^= z->len[k];
+	return 0;
+}
+
+/*
+ * Overlay state.  These only update the local tables: it's up to
+ * the caller to tell the other nodes about the changes.
+ */
+
+void
+can_init(struct can *c, struct node *self)
+{
+	memset(c, 0, sizeof(*c));
+	c->self = self;
+}
 
 void
-random_point(uint64_t *a, uint64_t *b)
+can_free(struct can *c)
+{
+	int k;
+
+	for (k = 0; k < CAN_DIMS; ++k) {
+		free(c->nlo[k]);
+		free(c->nlen[k]);
+	}
+	free(c->nnode);
+	memset(c, 0, sizeof(*c));
+}
+
+/* the first node of the overlay owns everything */
+void
+can_bootstrap(struct can *c)
+{
+	memset(&c->zones[0], 0, sizeof(c->zones[0]));
+	c->nzones = 1;
+}
+
+/* the zone of the i-th entry of the neighbor table */
+void
+can_neighbor(const struct can *c, size_t i, struct zone *z)
+{
+	int k;
+
+	for (k = 0; k < CAN_DIMS; ++k) {
+		z->lo[k] = c->nlo[k][i];
+		z->len[k] = c->nlen[k][i];
+	}
+}
+
+int
+can_owns(const struct can *c, const uint64_t *p)
+{
+	size_t i;
+
+	for (i = 0; i < c->nzones; ++i)
+		if (zone_contains(&c->zones[i], p))
+			return 1;
+	return 0;
+}
+
+static int
+adjacent_to_us(const struct can *c, const struct zone *z)
+{
+	size_t i;
+
+	for (i = 0; i < c->nzones; ++i)
+		if (zone_adjacent(&c->zones[i], z))
+			return 1;
+	return 0;
+}
+
+static int
+grow(void **p, size_t nmemb, size_t size)
+{
+	void *t;
+
+	if ((t = realloc(*p, nmemb * size)) == NULL)
+		return -1;
+	*p = t;
+	return 0;
+}
+
+static int
+neigh_add(struct can *c, struct node *n, const struct zone *z)
+{
+	size_t nalloc;
+	int k;
+
+	if (c->nneigh == c->nalloc) {
+		nalloc = c->nalloc == 0 ? 8 : c->nalloc * 2;
+		for (k = 0; k < CAN_DIMS; ++k) {
+			if (grow((void **)&c->nlo[k], nalloc,
+			    sizeof(uint64_t)) == -1 ||
+			    grow((void **)&c->nlen[k], nalloc,
+			    sizeof(uint64_t)) == -1)
+				return -1;
+		}
+		if (grow((void **)&c->nnode, nalloc,
+		    sizeof(struct node *)) == -1)
+			return -1;
+		c->nalloc = nalloc;
+	}
+
+	for (k = 0; k < CAN_DIMS; ++k) {
+		c->nlo[k][c->nneigh] = z->lo[k];
+		c->nlen[k][c->nneigh] = z->len[k];
+	}
+	c->nnode[c->nneigh] = n;
+	c->nneigh++;
+	return 0;
+}
+
+/* the order of the table doesn't matter: fill the hole with the last */
+static void
+neigh_del(struct can *c, size_t i)
 {
-	arc4random_buf(a, sizeof(*a));
-	arc4random_buf(b, sizeof(*b));
+	int k;
+
+	c->nneigh--;
+	for (k = 0; k < CAN_DIMS; ++k) {
+		c->nlo[k][i] = c->nlo[k][c->nneigh];
+		c->nlen[k][i] = c->nlen[k][c->nneigh];
+	}
+	c->nnode[i] = c->nnode[c->nneigh];
 }
 
+/*
+ * Give away the zone containing p to a joining node.  If we hold
+ * more than one zone it's handed over whole, otherwise it's split in
+ * half and the newcomer gets the half with p.  The zone for the
+ * newcomer is stored in z.  The neighbor table is left untouched so
+ * that the caller can still notify everyone; see can_prune.
+ */
 int
-conn_towards(struct node *n)
+can_split(struct can *c, const uint64_t *p, struct zone *z)
 {
-	struct addrinfo hints, *servinfo, *p;
-	int status, sock;
+	struct zone *our;
+	size_t i;
+	int k;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	for (i = 0; i < c->nzones; ++i)
+		if (zone_contains(&c->zones[i], p))
+			break;
+	if (i == c->nzones)
+		return -1;
 
-	if ((status = getaddrinfo(n->hostname, n->portno, &hints, &servinfo)) != 0) {
-		log_warn("couldn't resolve %s:%s: %s",
-		    n->hostname, n->portno, gai_strerror(status));
+	if (c->nzones > 1) {
+		*z = c->zones[i];
+		c->zones[i] = c->zones[--c->nzones];
+		return 0;
+	}
+
+	our = &c->zones[0];
+	k = split_axis(our);
+	if (our->len[k] == 1)
+		return -1;
+
+	our->len[k] = our->len[k] == 0 ? 1ULL << 63 : our->len[k] / 2;
+	*z = *our;
+	if (zone_contains(our, p))
+		our->lo[k] += our->len[k];
+	else
+		z->lo[k] += our->len[k];
+	return 0;
+}
+
+/* merge sibling zones back into their parent for as long as we can */
+static void
+coalesce(struct can *c)
+{
+	struct zone sib, *z;
+	size_t i, j;
+	int k;
+
+again:
+	for (i = 0; i < c->nzones; ++i) {
+		z = &c->zones[i];
+		if (zone_sibling(z, &sib) == -1)
+			continue;
+		for (j = 0; j < c->nzones; ++j) {
+			if (!zone_equal(&c->zones[j], &sib))
+				continue;
+			k = last_split_axis(z);
+			z->lo[k] &= ~z->len[k];
+			z->len[k] *= 2;		/* 2^63 * 2 wraps to 0 */
+			c->zones[j] = c->zones[--c->nzones];
+			goto again;
+		}
+	}
+}
+
+/*
+ * Take over the zone of a node that's leaving, merging it with ours
+ * when they're siblings.  Its neighbors have then to be fed to
+ * can_update.
+ */
+int
+can_takeover(struct can *c, const struct zone *z)
+{
+	if (c->nzones == CAN_MAXZONES)
 		return -1;
+
+	c->zones[c->nzones++] = *z;
+	coalesce(c);
+	return 0;
+}
+
+/*
+ * Add a zone of the node n to the neighbor table, if it's adjacent
+ * to us and not there yet.
+ */
+int
+can_add(struct can *c, struct node *n, const struct zone *z)
+{
+	struct zone t;
+	size_t i;
+
+	if (n == c->self || !adjacent_to_us(c, z))
+		return 0;
+
+	for (i = 0; i < c->nneigh; ++i) {
+		if (c->nnode[i] != n)
+			continue;
+		can_neighbor(c, i, &t);
+		if (zone_equal(&t, z))
+			return 0;
 	}
 
-	sock = -1;
-	for (p = servinfo; p != NULL; p = p->ai_next) {
-		if ((sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+	return neigh_add(c, n, z);
+}
+
+/*
+ * The node n now owns the given zones: keep the ones adjacent to us
+ * in the neighbor table and forget about the others.
+ */
+int
+can_update(struct can *c, struct node *n, const struct zone *zs, size_t nz)
+{
+	size_t i;
+
+	if (n == c->self)
+		return 0;
+
+	can_remove(c, n);
+	for (i = 0; i < nz; ++i) {
+		if (!adjacent_to_us(c, &zs[i]))
 			continue;
-		if (connect(sock, p->ai_addr, p->ai_addrlen) != -1)
-			break;
-		close(sock);
+		if (neigh_add(c, n, &zs[i]) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+void
+can_remove(struct can *c, struct node *n)
+{
+	size_t i;
+
+	for (i = 0; i < c->nneigh; )
+		if (c->nnode[i] == n)
+			neigh_del(c, i);
+		else
+			i++;
+}
+
+/* drop the neighbors we're no longer adjacent to after a change */
+void
+can_prune(struct can *c)
+{
+	struct zone z;
+	size_t i;
+
+	for (i = 0; i < c->nneigh; ) {
+		can_neighbor(c, i, &z);
+		if (!adjacent_to_us(c, &z))
+			neigh_del(c, i);
+		else
+			i++;
 	}
+}
 
-	if (sock == -1) {
-		log_warn("couldn't connect to %s%s",
-		    n->hostname, n->portno);
+/* how many zones of n we know about */
+static size_t
+neigh_zones(const struct can *c, const struct node *n)
+{
+	size_t i, cnt = 0;
+
+	for (i = 0; i < c->nneigh; ++i)
+		if (c->nnode[i] == n)
+			cnt++;
+	return cnt;
+}
+
+/*
+ * Who should take over our zones when we leave: the neighbor that
+ * owns the sibling of our zone, so that they merge back, or else the
+ * one with the fewest and then smallest zones.  NULL if we're alone.
+ */
+struct node *
+can_successor(const struct can *c)
+{
+	struct zone sib, z;
+	size_t i, best, n, bestn;
+	int v, bestv;
+
+	if (c->nneigh == 0)
+		return NULL;
+
+	if (c->nzones == 1 && zone_sibling(&c->zones[0], &sib) == 0) {
+		for (i = 0; i < c->nneigh; ++i) {
+			can_neighbor(c, i, &z);
+			if (zone_equal(&z, &sib))
+				return c->nnode[i];
+		}
 	}
 
-	freeaddrinfo(servinfo);
-	return sock;
+	best = 0;
+	bestn = neigh_zones(c, c->nnode[0]);
+	can_neighbor(c, 0, &z);
+	bestv = zone_volume(&z);
+	for (i = 1; i < c->nneigh; ++i) {
+		n = neigh_zones(c, c->nnode[i]);
+		can_neighbor(c, i, &z);
+		v = zone_volume(&z);
+		if (n < bestn || (n == bestn && v < bestv)) {
+			best = i;
+			bestn = n;
+			bestv = v;
+		}
+	}
+	return c->nnode[best];
 }
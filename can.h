@@ -17,19 +17,90 @@
 #ifndef HIRO_CAN_H
 #define HIRO_CAN_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "config.h"
 #include "queue.h"
 
+/*
+ * The coordinate space is a CAN_DIMS-dimensional torus with 2^64
+ * points along every axis.  CAN_DIMS comes from the can_dims meson
+ * option: a route takes about CAN_DIMS/4 * n^(1/CAN_DIMS) hops, at
+ * the cost of 2*CAN_DIMS neighbors per node.  It's a constant so
+ * that the loops over the axes get unrolled.
+ */
+#ifndef CAN_DIMS
+#define CAN_DIMS	2
+#endif
+
+#if CAN_DIMS < 1
+#error "CAN_DIMS must be at least 1"
+#endif
+
+/* zones a node can hold after taking over the ones of others */
+#define CAN_MAXZONES	8
+
+/*
+ * A zone is the box [lo, lo + len) along every axis; len is always
+ * a power of two and 0 stands for the whole axis (2^64).  Zones are
+ * only made by splitting the space in halves and merging them back,
+ * so they never wrap around.
+ */
+struct zone {
+	uint64_t	 lo[CAN_DIMS];
+	uint64_t	 len[CAN_DIMS];
+};
+
+struct peer;
+
 struct node {
-	uint64_t	 x, y;
-	uint64_t	 h, w;
+	uint64_t	 id;
 	const char	*hostname;
 	const char	*portno;
+	struct peer	*peer;		/* link to it, if any */
+	uint32_t	 rtt;		/* smoothed, in us; 0 if unknown */
 	LIST_ENTRY(node) node;
 };
 
-void		 random_point(uint64_t*, uint64_t*);
-int		 conn_towards(struct node*);
+/*
+ * The state of a node in the overlay: the zones it owns and its
+ * neighbor table.  The table has one entry per zone of a neighbor
+ * and is a structure of arrays, one per coordinate, so that routing
+ * scans contiguous memory.
+ */
+struct can {
+	struct node	*self;
+	struct zone	 zones[CAN_MAXZONES];
+	size_t		 nzones;
+
+	uint64_t	*nlo[CAN_DIMS];
+	uint64_t	*nlen[CAN_DIMS];
+	struct node	**nnode;
+	size_t		 nneigh;
+	size_t		 nalloc;
+};
+
+void		 random_point(uint64_t *);
+
+int		 zone_contains(const struct zone*, const uint64_t*);
+int		 zone_adjacent(const struct zone*, const struct zone*);
+int		 zone_side(const struct zone*, const struct zone*, int*);
+int		 zone_volume(const struct zone*);
+int		 zone_sibling(const struct zone*, struct zone*);
+
+void		 can_init(struct can*, struct node*);
+void		 can_free(struct can*);
+void		 can_bootstrap(struct can*);
+void		 can_neighbor(const struct can*, size_t, struct zone*);
+int		 can_owns(const struct can*, const uint64_t*);
+int		 can_split(struct can*, const uint64_t*, struct zone*);
+int		 can_takeover(struct can*, const struct zone*);
+int		 can_add(struct can*, struct node*, const struct zone*);
+int		 can_update(struct can*, struct node*, const struct zone*,
+		    size_t);
+void		 can_remove(struct can*, struct node*);
+void		 can_prune(struct can*);
+struct node	*can_successor(const struct can*);
 
 #endif
@@ -16,75 +16,276 @@
 
 #include "cmd.h"
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-/* todo: add checks for write errors */
+/*
+ * Write all the iovecs, retrying on short writes.  Meant for
+ * blocking descriptors: EAGAIN is reported as an error.
+ */
+static int
+writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t r;
+
+	while (iovcnt > 0) {
+		if ((r = writev(fd, iov, iovcnt)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for (; iovcnt > 0 && (size_t)r >= iov->iov_len; iov++, iovcnt--)
+			r -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Send cmd as a single frame.  If cmd->data is set it's sent as-is,
+ * otherwise the payload is made by the argc strings in argv.
+ */
 int
 send_cmd(int fd, struct cmd *cmd)
 {
+	struct cmd_hdr hdr;
+	struct iovec iov[CMD_MAXARGS + 1];
 	size_t len;
-	int i;
+	int i, n;
 
-	write(fd, &cmd->type, sizeof(cmd->type));
-	write(fd, &cmd->argc, sizeof(cmd->argc));
+	if (cmd->argc < 0)
+		return -1;
 
-	if (cmd->argc == 0)
-		return 0;
+	n = 0;
+	iov[n].iov_base = &hdr;
+	iov[n].iov_len = sizeof(hdr);
+	n++;
 
-	len = 0;
-	for (i = 0; i < cmd->argc; ++i)
-		len += strlen(cmd->argv[i]) + 1;
+	if (cmd->data != NULL) {
+		len = cmd->len;
+		iov[n].iov_base = cmd->data;
+		iov[n].iov_len = len;
+		n++;
+	} else {
+		if (cmd->argc > CMD_MAXARGS)
+			return -1;
 
-	write(fd, &len, sizeof(len));
-	for (i = 0; i < cmd->argc; ++i)
-		write(fd, cmd->argv[i], strlen(cmd->argv[i]) +1);
-	return 0;
+		len = 0;
+		for (i = 0; i < cmd->argc; ++i) {
+			iov[n].iov_base = cmd->argv[i];
+			iov[n].iov_len = strlen(cmd->argv[i]) + 1;
+			len += iov[n].iov_len;
+			n++;
+		}
+	}
+
+	if (len > CMD_MAXLEN) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	hdr.type = cmd->type;
+	hdr.argc = cmd->argc;
+	hdr.len = len;
+
+	return writev_all(fd, iov, n);
 }
 
-/* todo: add checks for read errors */
+/*
+ * Blocking counterpart of recv_cmd: read from fd until a whole frame
+ * is in buf.  Returns 0 on success and -1 on error or EOF.
+ */
 int
-recv_cmd(int fd, struct cmd *cmd)
+read_cmd(int fd, struct cmdbuf *buf, struct cmd *cmd)
 {
-	size_t len;
-	int i;
-	char *args;
+	int r;
 
-	cmd->argv = NULL;
+	while ((r = recv_cmd(buf, cmd)) == 0) {
+		if (cmdbuf_read(fd, buf) <= 0)
+			return -1;
+	}
+
+	return r == 1 ? 0 : -1;
+}
 
-	if (read(fd, &cmd->type, sizeof(cmd->type)) <= 0)
+/*
+ * Read what's available from fd into buf, after moving the bytes
+ * not yet consumed to the start of it.  Returns like read(2), and
+ * fails with ENOBUFS rather than reading nothing when buf is full.
+ */
+ssize_t
+cmdbuf_read(int fd, struct cmdbuf *buf)
+{
+	ssize_t r;
+
+	if (buf->off != 0) {
+		buf->len -= buf->off;
+		memmove(buf->data, buf->data + buf->off, buf->len);
+		buf->off = 0;
+	}
+
+	if (buf->len == sizeof(buf->data)) {
+		errno = ENOBUFS;
 		return -1;
+	}
+
+	r = read(fd, buf->data + buf->len, sizeof(buf->data) - buf->len);
+	if (r > 0)
+		buf->len += r;
+	return r;
+}
+
+/*
+ * Write to fd what's pending in buf.  Returns like write(2).
+ */
+ssize_t
+cmdbuf_write(int fd, struct cmdbuf *buf)
+{
+	ssize_t r;
 
-	read(fd, &cmd->argc, sizeof(cmd->argc));
+	if ((r = write(fd, buf->data + buf->off, buf->len - buf->off)) > 0)
+		buf->off += r;
+
+	if (buf->off == buf->len)
+		buf->off = buf->len = 0;
+
+	return r;
+}
+
+/*
+ * Parse the next frame in buf in place.  Returns 1 and fills cmd if
+ * a whole frame was available, 0 if more data is needed and -1 if
+ * the frame is malformed.
+ */
+int
+recv_cmd(struct cmdbuf *buf, struct cmd *cmd)
+{
+	struct cmd_hdr hdr;
+	size_t avail;
+	uint32_t i;
+	char *p, *q, *end;
 
-	if (cmd->argc == 0)
+	avail = buf->len - buf->off;
+	if (avail < sizeof(hdr))
 		return 0;
 
-	read(fd, &len, sizeof(len));
+	memcpy(&hdr, buf->data + buf->off, sizeof(hdr));
 
-	if ((args = calloc(1, len)) == NULL)
-		return -1;
-	if ((cmd->argv = calloc(1, cmd->argc+1)) == NULL)
+	if (hdr.len > CMD_MAXLEN || hdr.argc > hdr.len || hdr.argc > INT_MAX)
 		return -1;
 
-	read(fd, args, len);
+	if (avail < sizeof(hdr) + hdr.len)
+		return 0;
+
+	p = buf->data + buf->off + sizeof(hdr);
+	end = p + hdr.len;
 
-	for (i = 0; i < cmd->argc; ++i) {
-		cmd->argv[i] = args;
-		args = strchr(args, '\0');
+	cmd->type = hdr.type;
+	cmd->argc = hdr.argc;
+	cmd->data = p;
+	cmd->len = hdr.len;
 
-		/* if we don't find a NUL terminator... we have
-		 * already have been killed for a SIGSEV,
-		 * probably */
-		if (args == NULL)
+	for (i = 0; i < hdr.argc; ++i) {
+		if ((q = memchr(p, '\0', end - p)) == NULL)
 			return -1;
-		args++;
+		if (i < CMD_MAXARGS)
+			cmd->argv[i] = p;
+		p = q + 1;
 	}
+	if (p != end)
+		return -1;
+	cmd->argv[i < CMD_MAXARGS ? i : CMD_MAXARGS] = NULL;
+
+	buf->off += sizeof(hdr) + hdr.len;
+	return 1;
+}
 
+/*
+ * Append cmd as a frame to buf, built like in send_cmd.  Returns -1
+ * if it doesn't fit.
+ */
+int
+cmd_encode(struct cmdbuf *buf, struct cmd *cmd)
+{
+	struct cmd_hdr hdr;
+	size_t len, l;
+	char *p;
+	int i;
+
+	if (cmd->argc < 0 || (cmd->data == NULL && cmd->argc > CMD_MAXARGS))
+		return -1;
+
+	if (cmd->data != NULL)
+		len = cmd->len;
+	else {
+		len = 0;
+		for (i = 0; i < cmd->argc; ++i)
+			len += strlen(cmd->argv[i]) + 1;
+	}
+
+	if (sizeof(buf->data) - (buf->len - buf->off) < sizeof(hdr) + len)
+		return -1;
+
+	if (sizeof(buf->data) - buf->len < sizeof(hdr) + len) {
+		buf->len -= buf->off;
+		memmove(buf->data, buf->data + buf->off, buf->len);
+		buf->off = 0;
+	}
+
+	hdr.type = cmd->type;
+	hdr.argc = cmd->argc;
+	hdr.len = len;
+
+	p = buf->data + buf->len;
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+
+	if (cmd->data != NULL)
+		memcpy(p, cmd->data, len);
+	else {
+		for (i = 0; i < cmd->argc; ++i) {
+			l = strlen(cmd->argv[i]) + 1;
+			memcpy(p, cmd->argv[i], l);
+			p += l;
+		}
+	}
+
+	buf->len += sizeof(hdr) + len;
 	return 0;
 }
 
+/*
+ * Copy a command parsed by recv_cmd together with its payload, to
+ * keep it past the next read on its cmdbuf.  Free it with free(3).
+ */
+struct cmd *
+cmd_dup(const struct cmd *cmd)
+{
+	struct cmd *c;
+	int i;
+
+	if ((c = malloc(sizeof(*c) + cmd->len)) == NULL)
+		return NULL;
+
+	*c = *cmd;
+	c->data = (char *)(c + 1);
+	memcpy(c->data, cmd->data, cmd->len);
+	for (i = 0; i < cmd->argc && i < CMD_MAXARGS; ++i)
+		c->argv[i] = c->data + (cmd->argv[i] - cmd->data);
+	return c;
+}
+
 const char *
 cmd_name(enum cmd_type type)
 {
@@ -97,6 +298,48 @@ cmd_name(enum cmd_type type)
 		return "recv";
 	case CMD_PING:
 		return "ping";
+	case CMD_SEND_BATCH:
+		return "send-batch";
+	case CMD_STATS:
+		return "stats";
+	case CMD_FORWARD:
+		return "forward";
+	case CMD_PUT:
+		return "put";
+	case CMD_GET:
+		return "get";
+	case CMD_DEL:
+		return "del";
+	case CMD_BROADCAST:
+		return "broadcast";
+	case CMD_JOIN:
+		return "join";
+	case CMD_WELCOME:
+		return "welcome";
+	case CMD_UPDATE:
+		return "update";
+	case CMD_HELLO:
+		return "hello";
+	case CMD_RESULT:
+		return "result";
+	case CMD_PROBE:
+		return "probe";
+	case CMD_ECHO:
+		return "echo";
+	case CMD_SUBSCRIBE:
+		return "subscribe";
+	case CMD_UNSUBSCRIBE:
+		return "unsubscribe";
+	case CMD_PUBLISH:
+		return "publish";
+	case CMD_DELIVER:
+		return "deliver";
+	case CMD_LEAVE:
+		return "leave";
+	case CMD_OK:
+		return "ok";
+	case CMD_ERROR:
+		return "error";
 	default:
 		return "unknown command";
 	}
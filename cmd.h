@@ -17,21 +17,85 @@
 #ifndef HIRO_CMD_H
 #define HIRO_CMD_H
 
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CMD_MAXARGS	16
+#define CMD_BUFSIZE	(64 * 1024)
+#define CMD_MAXLEN	(CMD_BUFSIZE - sizeof(struct cmd_hdr))
+
 enum cmd_type {
 	CMD_RESTART,
 	CMD_SEND,
 	CMD_RECV,
 	CMD_PING,		/* testing */
+	CMD_SEND_BATCH,
+	CMD_STATS,
+	CMD_FORWARD,
+	CMD_PUT,
+	CMD_GET,
+	CMD_DEL,
+	CMD_BROADCAST,
+
+	/* between nodes */
+	CMD_JOIN,
+	CMD_WELCOME,
+	CMD_UPDATE,
+	CMD_HELLO,
+	CMD_RESULT,
+	CMD_PROBE,
+	CMD_ECHO,
+	CMD_SUBSCRIBE,
+	CMD_UNSUBSCRIBE,
+	CMD_PUBLISH,
+	CMD_DELIVER,
+	CMD_LEAVE,
+
+	/* replies */
+	CMD_OK,
+	CMD_ERROR,
 };
 
+/*
+ * A frame on the ctl socket is a fixed header followed by `len'
+ * bytes holding `argc' NUL-terminated strings.
+ */
+struct cmd_hdr {
+	uint32_t	type;
+	uint32_t	argc;
+	uint32_t	len;
+};
+
+/*
+ * A decoded command.  argv and data point inside the cmdbuf the
+ * command was parsed from, so they're valid only until the next
+ * cmdbuf_read on it.  Only the first CMD_MAXARGS arguments are
+ * split into argv, the whole list is always available in data.
+ */
 struct cmd {
 	enum cmd_type	  type;
 	int		  argc;
-	char		**argv;
+	char		 *argv[CMD_MAXARGS + 1];
+	char		 *data;
+	size_t		  len;
+};
+
+/* per-connection input buffer for the incremental decoder */
+struct cmdbuf {
+	size_t		  off;
+	size_t		  len;
+	char		  data[CMD_BUFSIZE];
 };
 
 int		 send_cmd(int, struct cmd*);
-int		 recv_cmd(int, struct cmd*);
+int		 read_cmd(int, struct cmdbuf*, struct cmd*);
+ssize_t		 cmdbuf_read(int, struct cmdbuf*);
+ssize_t		 cmdbuf_write(int, struct cmdbuf*);
+int		 recv_cmd(struct cmdbuf*, struct cmd*);
+int		 cmd_encode(struct cmdbuf*, struct cmd*);
+struct cmd	*cmd_dup(const struct cmd*);
 const char	*cmd_name(enum cmd_type);
 
 #endif
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "dedup.h"
+
+#include <string.h>
+
+#define GAMMA	0x9e3779b97f4a7c15ULL
+
+void
+dedup_init(struct dedup *d)
+{
+	memset(d, 0, sizeof(*d));
+}
+
+static void
+dedup_next(struct dedup *d)
+{
+	d->cur = (d->cur + 1) % DEDUP_BUCKETS;
+	memset(d->ids[d->cur], 0, sizeof(d->ids[d->cur]));
+	d->count[d->cur] = 0;
+}
+
+static inline size_t
+slot(uint64_t id)
+{
+	return ((id * GAMMA) >> 32) & (DEDUP_SLOTS - 1);
+}
+
+static int
+lookup(const uint64_t *ids, uint64_t id)
+{
+	size_t i;
+
+	for (i = slot(id); ids[i] != 0; i = (i + 1) & (DEDUP_SLOTS - 1))
+		if (ids[i] == id)
+			return 1;
+	return 0;
+}
+
+/*
+ * Whether id was seen already; if not it's remembered from now on.
+ * now is in ns.  The id 0 is never a duplicate.
+ */
+int
+dedup_seen(struct dedup *d, uint64_t id, uint64_t now)
+{
+	uint64_t period;
+	size_t i;
+	int b;
+
+	if (id == 0)
+		return 0;
+
+	/* a bucket per period, emptied when it comes round again */
+	period = now / (DEDUP_SEC * 1000000000ULL);
+	if (period != d->period) {
+		for (b = 0; b < DEDUP_BUCKETS && d->period + b < period; ++b)
+			dedup_next(d);
+		d->period = period;
+	}
+
+	for (b = 0; b < DEDUP_BUCKETS; ++b)
+		if (lookup(d->ids[b], id))
+			return 1;
+
+	/* keep the load factor below 3/4 */
+	if (d->count[d->cur] >= DEDUP_SLOTS / 4 * 3)
+		dedup_next(d);
+
+	for (i = slot(id); d->ids[d->cur][i] != 0;
+	    i = (i + 1) & (DEDUP_SLOTS - 1))
+		;
+	d->ids[d->cur][i] = id;
+	d->count[d->cur]++;
+	return 0;
+}
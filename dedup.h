@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_DEDUP_H
+#define HIRO_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A filter of the message ids seen in the last few seconds.  Time is
+ * cut in periods of DEDUP_SEC seconds, each with its own bucket: an
+ * open addressing set of the ids first seen in it.  An id is a
+ * duplicate if it's in any of the last DEDUP_BUCKETS buckets, and
+ * the oldest bucket is emptied, in one go, when a period starts.  A
+ * bucket that fills up starts the next period early.
+ */
+#define DEDUP_BUCKETS	3
+#define DEDUP_SEC	2
+#define DEDUP_SLOTS	8192		/* per bucket, a power of two */
+
+struct dedup {
+	uint64_t	 period;
+	int		 cur;
+	size_t		 count[DEDUP_BUCKETS];
+	uint64_t	 ids[DEDUP_BUCKETS][DEDUP_SLOTS];
+};
+
+void		 dedup_init(struct dedup*);
+int		 dedup_seen(struct dedup*, uint64_t, uint64_t);
+
+#endif
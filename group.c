@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "group.h"
+#include "key.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define GROUPS_MINBUCKETS	64
+
+int
+groups_init(struct groups *gs)
+{
+	LIST_INIT(&gs->all);
+	gs->count = 0;
+	gs->nbuckets = GROUPS_MINBUCKETS;
+	gs->buckets = calloc(gs->nbuckets, sizeof(*gs->buckets));
+	return gs->buckets == NULL ? -1 : 0;
+}
+
+/* double the buckets, keeping the old ones if we run out of memory */
+static void
+groups_grow(struct groups *gs)
+{
+	struct group **b, *g, *next;
+	size_t i, n;
+
+	n = gs->nbuckets * 2;
+	if ((b = calloc(n, sizeof(*b))) == NULL)
+		return;
+
+	for (i = 0; i < gs->nbuckets; ++i) {
+		for (g = gs->buckets[i]; g != NULL; g = next) {
+			next = g->next;
+			g->next = b[g->hash & (n - 1)];
+			b[g->hash & (n - 1)] = g;
+		}
+	}
+
+	free(gs->buckets);
+	gs->buckets = b;
+	gs->nbuckets = n;
+}
+
+static struct group *
+lookup(struct groups *gs, const char *name, size_t len, uint64_t h)
+{
+	struct group *g;
+
+	for (g = gs->buckets[h & (gs->nbuckets - 1)]; g != NULL; g = g->next)
+		if (g->hash == h && g->len == len &&
+		    !memcmp(g->name, name, len))
+			return g;
+	return NULL;
+}
+
+struct group *
+group_find(struct groups *gs, const char *name)
+{
+	size_t len;
+
+	len = strlen(name);
+	return lookup(gs, name, len, key_hash(name, len));
+}
+
+/* the group of the topic, created empty if needed */
+struct group *
+group_get(struct groups *gs, const char *name)
+{
+	struct group *g;
+	size_t len;
+	uint64_t h;
+
+	len = strlen(name);
+	h = key_hash(name, len);
+	if ((g = lookup(gs, name, len, h)) != NULL)
+		return g;
+
+	if ((g = calloc(1, sizeof(*g) + len + 1)) == NULL)
+		return NULL;
+	g->hash = h;
+	g->len = len;
+	memcpy(g->name, name, len);
+
+	if (gs->count >= gs->nbuckets)
+		groups_grow(gs);
+	g->next = gs->buckets[h & (gs->nbuckets - 1)];
+	gs->buckets[h & (gs->nbuckets - 1)] = g;
+	LIST_INSERT_HEAD(&gs->all, g, entry);
+	gs->count++;
+	return g;
+}
+
+void
+group_del(struct groups *gs, struct group *g)
+{
+	struct group **gp;
+
+	for (gp = &gs->buckets[g->hash & (gs->nbuckets - 1)]; *gp != g;
+	     gp = &(*gp)->next)
+		;
+	*gp = g->next;
+	LIST_REMOVE(g, entry);
+	gs->count--;
+	free(g->children);
+	free(g);
+}
+
+/* add n to the children of g, or refresh it, until expires */
+int
+group_join(struct group *g, struct node *n, uint64_t expires)
+{
+	struct member *m;
+	size_t i, cap;
+
+	for (i = 0; i < g->nchildren; ++i) {
+		if (g->children[i].node == n) {
+			g->children[i].expires = expires;
+			return 0;
+		}
+	}
+
+	if (g->nchildren == g->cap) {
+		cap = g->cap == 0 ? 4 : g->cap * 2;
+		m = reallocarray(g->children, cap, sizeof(*m));
+		if (m == NULL)
+			return -1;
+		g->children = m;
+		g->cap = cap;
+	}
+
+	g->children[g->nchildren].node = n;
+	g->children[g->nchildren].expires = expires;
+	g->nchildren++;
+	return 0;
+}
+
+void
+group_leave(struct group *g, struct node *n)
+{
+	size_t i;
+
+	for (i = 0; i < g->nchildren; ++i) {
+		if (g->children[i].node == n) {
+			g->children[i] = g->children[--g->nchildren];
+			return;
+		}
+	}
+}
+
+/* drop the children that didn't subscribe again before now */
+void
+group_expire(struct group *g, uint64_t now)
+{
+	size_t i;
+
+	for (i = 0; i < g->nchildren; ) {
+		if (g->children[i].expires <= now)
+			g->children[i] = g->children[--g->nchildren];
+		else
+			i++;
+	}
+}
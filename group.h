@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_GROUP_H
+#define HIRO_GROUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "queue.h"
+
+struct node;
+
+/* a node below us in the tree of a topic, until it expires */
+struct member {
+	struct node	*node;
+	uint64_t	 expires;	/* ns */
+};
+
+/*
+ * The multicast tree of a topic as seen by a node: whether it has
+ * local subscribers, the nodes that subscribed through it and the
+ * node it subscribed to in turn, that is NULL at the rendezvous.
+ */
+struct group {
+	struct group		*next;		/* in the bucket */
+	uint64_t		 hash;
+	int			 local;		/* workers with subscribers */
+	struct node		*parent;
+	struct member		*children;
+	size_t			 nchildren;
+	size_t			 cap;
+	LIST_ENTRY(group)	 entry;
+	size_t			 len;
+	char			 name[];
+};
+
+/* hash table from the topic name to its group */
+struct groups {
+	struct group		**buckets;
+	size_t			 nbuckets;
+	size_t			 count;
+	LIST_HEAD(, group)	 all;
+};
+
+int		 groups_init(struct groups*);
+struct group	*group_find(struct groups*, const char*);
+struct group	*group_get(struct groups*, const char*);
+void		 group_del(struct groups*, struct group*);
+int		 group_join(struct group*, struct node*, uint64_t);
+void		 group_leave(struct group*, struct node*);
+void		 group_expire(struct group*, uint64_t);
+
+#endif
@@ -19,4 +19,82 @@
 
 /* here be dragons */
 
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <event.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cmd.h"
+#include "queue.h"
+#include "wheel.h"
+
+struct stats;
+
+/* something to run on another worker */
+struct task {
+	void		(*fn)(void*);
+	void		 *arg;
+};
+
+/*
+ * Single-producer single-consumer ring of tasks.  Every worker has
+ * one for each other worker that can hand something over to it.
+ * When it's full the producer keeps the tasks aside, in order, and
+ * sets spilled: the consumer kicks it back once it made room.
+ */
+#define RING_SIZE	2048
+
+struct ring {
+	size_t		 tail __attribute__((aligned(64)));
+	int		 spilled;
+	size_t		 head __attribute__((aligned(64)));
+	struct task	 tasks[RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct spill {
+	TAILQ_ENTRY(spill)	 entry;
+	struct task		 task;
+};
+
+TAILQ_HEAD(spills, spill);
+
+/*
+ * Every worker runs its own event loop on its own thread and owns
+ * the connections it accepted.
+ */
+struct worker {
+	int			 id;
+	pthread_t		 thread;
+	struct event_base	*base;
+	struct stats		*stats;
+
+	struct ring		*inbox;		/* one per worker */
+	struct spills		*spills;	/* for each worker's ring */
+	int			 wakeup[2];
+	int			 signalled;
+	struct event		 wakeev;
+	struct wheel		 wheel;		/* the timers of the worker */
+
+	void			(*init)(struct worker*);
+	void			(*idle)(void);	/* after every loop */
+};
+
+extern int		 nworkers;
+extern struct worker	*workers;
+extern __thread struct worker *worker;
+
+int		 workers_init(int, void (*)(struct worker*));
+void		 workers_run(void);
+void		 worker_event_set(struct event*, int, short,
+		    void (*)(int, short, void*), void*);
+int		 worker_post(struct worker*, void (*)(void*), void*);
+void		 worker_kick(struct worker*);
+
+/* hirod.c */
+int		 publish_msg(const char*, const char*, size_t);
+void		 kv_answer(uint64_t, enum cmd_type, const char*);
+
 #endif
@@ -22,7 +22,10 @@
 #include <sys/un.h>
 
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,6 +45,21 @@ void		 cmd_recv_usage(void) dead_attr;
 int		 cmd_ping(int, char**);
 void		 cmd_ping_usage(void) dead_attr;
 
+int		 cmd_stats(int, char**);
+void		 cmd_stats_usage(void) dead_attr;
+
+int		 cmd_put(int, char**);
+void		 cmd_put_usage(void) dead_attr;
+
+int		 cmd_get(int, char**);
+void		 cmd_get_usage(void) dead_attr;
+
+int		 cmd_del(int, char**);
+void		 cmd_del_usage(void) dead_attr;
+
+int		 cmd_session(int, char**);
+void		 cmd_session_usage(void) dead_attr;
+
 typedef int(*cmdmainfn)(int, char**);
 
 struct cmddef {
@@ -52,12 +70,42 @@ struct cmddef {
 	{ "send",	cmd_send },
 	{ "recv",	cmd_recv },
 	{ "ping",	cmd_ping },
+	{ "stats",	cmd_stats },
+	{ "put",	cmd_put },
+	{ "get",	cmd_get },
+	{ "del",	cmd_del },
+	{ "session",	cmd_session },
 	{ NULL,		NULL },
 };
 
+/*
+ * Commands accepted in a session, one per line.  The last argument
+ * takes the rest of the line.
+ */
+struct sessdef {
+	const char	*cmd;
+	enum cmd_type	 type;
+	int		 argc;
+} sesscmds[] = {
+	{ "restart",	CMD_RESTART,	0 },
+	{ "send",	CMD_SEND,	2 },
+	{ "broadcast",	CMD_BROADCAST,	2 },
+	{ "ping",	CMD_PING,	0 },
+	{ "stats",	CMD_STATS,	0 },
+	{ "put",	CMD_PUT,	2 },
+	{ "get",	CMD_GET,	1 },
+	{ "del",	CMD_DEL,	1 },
+	{ NULL,		0,		0 },
+};
+
+/* max commands in flight in a session */
+#define SESSION_WINDOW	128
+
 const char *sockpath;
 int fd;
 
+struct cmdbuf ibuf, obuf;
+
 /* XXX: replace every instance with `getprogname'. */
 char *me;
 
@@ -71,7 +119,7 @@ usage(const char *me)
 static void
 io_copy(int from, int to)
 {
-	char buf[64];
+	char buf[BUFSIZ];
 	ssize_t len;
 
 	for (;;) {
@@ -81,6 +129,36 @@ io_copy(int from, int to)
 	}
 }
 
+static int
+print_reply(struct cmd *r)
+{
+	int i;
+
+	switch (r->type) {
+	case CMD_OK:
+		for (i = 0; i < r->argc && i < CMD_MAXARGS; ++i)
+			puts(r->argv[i]);
+		return 0;
+	case CMD_ERROR:
+		for (i = 0; i < r->argc && i < CMD_MAXARGS; ++i)
+			warnx("%s", r->argv[i]);
+		return 1;
+	default:
+		warnx("unexpected reply: %s", cmd_name(r->type));
+		return 1;
+	}
+}
+
+static int
+wait_reply(void)
+{
+	struct cmd r;
+
+	if (read_cmd(fd, &ibuf, &r) == -1)
+		errx(1, "failed to read the reply");
+	return print_reply(&r);
+}
+
 int
 cmd_restart(int argc, char **argv)
 {
@@ -88,11 +166,19 @@ cmd_restart(int argc, char **argv)
 		.type = CMD_RESTART,
 	};
 
+	optind = 0;
+	if (getopt(argc, argv, "") != -1)
+		cmd_restart_usage();
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		cmd_restart_usage();
+
 	if (send_cmd(fd, &cmd) == -1)
 		err(1, "cmd_restart");
 
-	io_copy(fd, 1);
-	return 0;
+	return wait_reply();
 }
 
 void dead_attr
@@ -102,37 +188,167 @@ cmd_restart_usage(void)
 	exit(1);
 }
 
+/*
+ * Queue a (to, payload) record in the batch.  Returns -1 when it
+ * doesn't fit, with the batch untouched.
+ */
+static int
+batch_add(struct cmd *cmd, char *buf, const char *to, const char *p,
+    size_t len)
+{
+	size_t tolen;
+
+	tolen = strlen(to) + 1;
+	if (CMD_MAXLEN - cmd->len < tolen + len + 1)
+		return -1;
+
+	memcpy(buf + cmd->len, to, tolen);
+	memcpy(buf + cmd->len + tolen, p, len);
+	buf[cmd->len + tolen + len] = '\0';
+	cmd->len += tolen + len + 1;
+	cmd->argc += 2;
+	return 0;
+}
+
+static void
+batch_flush(struct cmd *cmd, size_t *pending, int *ret)
+{
+	if (cmd->argc == 0)
+		return;
+
+	if (send_cmd(fd, cmd) == -1)
+		err(1, "cmd_send");
+	cmd->argc = 0;
+	cmd->len = 0;
+
+	if (++*pending == SESSION_WINDOW) {
+		*ret |= wait_reply();
+		--*pending;
+	}
+}
+
+/*
+ * Read from stdin a message per line, or length-prefixed messages
+ * if lflag is set, and send them to `to' in CMD_SEND_BATCH frames.
+ */
+static int
+send_stdin(const char *to, int lflag)
+{
+	static char buf[CMD_MAXLEN];
+	struct cmd cmd;
+	size_t pending, cap, len;
+	ssize_t linelen;
+	uint8_t hdr[4];
+	char *line;
+	int ret;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.type = CMD_SEND_BATCH;
+	cmd.data = buf;
+
+	line = NULL;
+	cap = 0;
+	pending = 0;
+	ret = 0;
+
+	for (;;) {
+		if (lflag) {
+			if (fread(hdr, 1, sizeof(hdr), stdin) != sizeof(hdr))
+				break;
+			len = (size_t)hdr[0] << 24 | hdr[1] << 16 |
+			    hdr[2] << 8 | hdr[3];
+			if (len > CMD_MAXLEN)
+				errx(1, "message too long: %zu bytes", len);
+			if (len + 1 > cap) {
+				free(line);
+				cap = len + 1;
+				if ((line = malloc(cap)) == NULL)
+					err(1, "malloc");
+			}
+			if (fread(line, 1, len, stdin) != len)
+				errx(1, "truncated message");
+		} else {
+			if ((linelen = getline(&line, &cap, stdin)) == -1)
+				break;
+			len = linelen;
+			if (len != 0 && line[len - 1] == '\n')
+				len--;
+		}
+
+		if (memchr(line, '\0', len) != NULL)
+			errx(1, "messages can't contain NUL bytes");
+
+		if (batch_add(&cmd, buf, to, line, len) == 0)
+			continue;
+
+		batch_flush(&cmd, &pending, &ret);
+		if (batch_add(&cmd, buf, to, line, len) == -1)
+			errx(1, "message too long: %zu bytes", len);
+	}
+
+	if (ferror(stdin))
+		err(1, "stdin");
+
+	batch_flush(&cmd, &pending, &ret);
+	while (pending-- != 0)
+		ret |= wait_reply();
+
+	free(line);
+	return ret;
+}
+
 int
 cmd_send(int argc, char **argv)
 {
 	struct cmd cmd = {
 		.type = CMD_SEND,
 	};
+	int ch, bflag = 0, lflag = 0;
 
-	if (getopt(argc, argv, "") != -1)
+	optind = 0;
+	while ((ch = getopt(argc, argv, "bl")) != -1) {
+		switch (ch) {
+		case 'b':
+			bflag = 1;
+			break;
+		case 'l':
+			lflag = 1;
+			break;
+		default:
+			cmd_send_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
 		cmd_send_usage();
 
-	/* argc -= optind; */
-	/* argv += optind; */
+	if (!strcmp(argv[1], "-") && !bflag)
+		return send_stdin(argv[0], lflag);
 
-	if (argc != 2)
+	if (lflag)
 		cmd_send_usage();
 
+	/* to the subscribers on every node */
+	if (bflag)
+		cmd.type = CMD_BROADCAST;
+
 	cmd.argc = argc;
-	cmd.argv = argv;
+	cmd.argv[0] = argv[0];
+	cmd.argv[1] = argv[1];
 
 	if (send_cmd(fd, &cmd) == -1)
 		err(1, "cmd_send");
 
-	io_copy(fd, 1);
-
-	return 0;
+	return wait_reply();
 }
 
 void dead_attr
 cmd_send_usage(void)
 {
-	fprintf(stderr, "USAGE: %s send <to> <what>\n", me);
+	fprintf(stderr, "USAGE: %s send [-b] <to> <what>\n", me);
+	fprintf(stderr, "       %s send [-l] <to> -\n", me);
 	exit(1);
 }
 
@@ -144,20 +360,25 @@ cmd_recv(int argc, char **argv)
 	};
 
 	optind = 0;
-
 	if (getopt(argc, argv, "") != -1)
 		cmd_recv_usage();
 	argc -= optind;
 	argv += optind;
 
-	/* XXX: investigate this.  Basically optind is at least 1, so
-	 * we go under 0... */
-	if (argc >= 0)
+	if (argc > CMD_MAXARGS)
 		cmd_recv_usage();
 
+	cmd.argc = argc;
+	memcpy(cmd.argv, argv, argc * sizeof(*argv));
+
 	if (send_cmd(fd, &cmd) == -1)
 		err(1, "cmd_send");
 
+	if (wait_reply() != 0)
+		return 1;
+
+	/* the messages may have arrived together with the reply */
+	write(1, ibuf.data + ibuf.off, ibuf.len - ibuf.off);
 	io_copy(fd, 1);
 
 	return 0;
@@ -166,7 +387,7 @@ cmd_recv(int argc, char **argv)
 void dead_attr
 cmd_recv_usage(void)
 {
-	fprintf(stderr, "USAGE: %s recv\n", me);
+	fprintf(stderr, "USAGE: %s recv [topic ...]\n", me);
 	exit(1);
 }
 
@@ -177,15 +398,19 @@ cmd_ping(int argc, char **argv)
 		.type = CMD_PING,
 	};
 
+	optind = 0;
+	if (getopt(argc, argv, "") != -1)
+		cmd_ping_usage();
+	argc -= optind;
+	argv += optind;
+
 	if (argc != 0)
 		cmd_ping_usage();
 
 	if (send_cmd(fd, &cmd) == -1)
 		err(1, "send_cmd");
 
-	io_copy(fd, 1);
-
-	return 0;
+	return wait_reply();
 }
 
 void dead_attr
@@ -195,6 +420,306 @@ cmd_ping_usage(void)
 	exit(1);
 }
 
+int
+cmd_stats(int argc, char **argv)
+{
+	struct cmd cmd = {
+		.type = CMD_STATS,
+	};
+
+	optind = 0;
+	if (getopt(argc, argv, "") != -1)
+		cmd_stats_usage();
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		cmd_stats_usage();
+
+	if (send_cmd(fd, &cmd) == -1)
+		err(1, "send_cmd");
+
+	return wait_reply();
+}
+
+void dead_attr
+cmd_stats_usage(void)
+{
+	fprintf(stderr, "USAGE: %s stats\n", me);
+	exit(1);
+}
+
+int
+cmd_put(int argc, char **argv)
+{
+	struct cmd cmd = {
+		.type = CMD_PUT,
+	};
+
+	optind = 0;
+	if (getopt(argc, argv, "") != -1)
+		cmd_put_usage();
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		cmd_put_usage();
+
+	cmd.argc = argc;
+	cmd.argv[0] = argv[0];
+	cmd.argv[1] = argv[1];
+
+	if (send_cmd(fd, &cmd) == -1)
+		err(1, "send_cmd");
+
+	return wait_reply();
+}
+
+void dead_attr
+cmd_put_usage(void)
+{
+	fprintf(stderr, "USAGE: %s put <key> <value>\n", me);
+	exit(1);
+}
+
+int
+cmd_get(int argc, char **argv)
+{
+	struct cmd cmd = {
+		.type = CMD_GET,
+	};
+
+	optind = 0;
+	if (getopt(argc, argv, "") != -1)
+		cmd_get_usage();
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		cmd_get_usage();
+
+	cmd.argc = argc;
+	cmd.argv[0] = argv[0];
+
+	if (send_cmd(fd, &cmd) == -1)
+		err(1, "send_cmd");
+
+	return wait_reply();
+}
+
+void dead_attr
+cmd_get_usage(void)
+{
+	fprintf(stderr, "USAGE: %s get <key>\n", me);
+	exit(1);
+}
+
+int
+cmd_del(int argc, char **argv)
+{
+	struct cmd cmd = {
+		.type = CMD_DEL,
+	};
+
+	optind = 0;
+	if (getopt(argc, argv, "") != -1)
+		cmd_del_usage();
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		cmd_del_usage();
+
+	cmd.argc = argc;
+	cmd.argv[0] = argv[0];
+
+	if (send_cmd(fd, &cmd) == -1)
+		err(1, "send_cmd");
+
+	return wait_reply();
+}
+
+void dead_attr
+cmd_del_usage(void)
+{
+	fprintf(stderr, "USAGE: %s del <key>\n", me);
+	exit(1);
+}
+
+static void
+flush_obuf(void)
+{
+	while (obuf.off != obuf.len) {
+		if (cmdbuf_write(fd, &obuf) == -1 && errno != EINTR)
+			err(1, "write");
+	}
+}
+
+/*
+ * Turn a line into a command and queue it in obuf.  Returns -1 if
+ * the line isn't a valid command.
+ */
+static int
+session_line(char *line, size_t lineno)
+{
+	struct sessdef *sd;
+	struct cmd cmd;
+	char *sub, *sp = " \t";
+
+	memset(&cmd, 0, sizeof(cmd));
+
+	line += strspn(line, sp);
+	sub = line;
+	line += strcspn(line, sp);
+	if (*line != '\0')
+		*line++ = '\0';
+
+	for (sd = sesscmds; sd->cmd != NULL; ++sd)
+		if (!strcmp(sd->cmd, sub))
+			break;
+
+	if (sd->cmd == NULL) {
+		warnx("line %zu: unknown command: %s", lineno, sub);
+		return -1;
+	}
+
+	cmd.type = sd->type;
+	for (cmd.argc = 0; cmd.argc < sd->argc; ++cmd.argc) {
+		line += strspn(line, sp);
+		if (*line == '\0') {
+			warnx("line %zu: %s needs %d arguments", lineno,
+			    sd->cmd, sd->argc);
+			return -1;
+		}
+
+		cmd.argv[cmd.argc] = line;
+		if (cmd.argc != sd->argc - 1) {
+			line += strcspn(line, sp);
+			if (*line != '\0')
+				*line++ = '\0';
+		}
+	}
+
+	if (cmd_encode(&obuf, &cmd) == 0)
+		return 0;
+
+	/* it may fit once what's queued already is sent */
+	if (obuf.off != obuf.len) {
+		flush_obuf();
+		if (cmd_encode(&obuf, &cmd) == 0)
+			return 0;
+	}
+
+	warnx("line %zu: command too long", lineno);
+	return -1;
+}
+
+/*
+ * Read commands from stdin, one per line, and pipeline them on a
+ * single connection.  Replies are printed in order.
+ */
+int
+cmd_session(int argc, char **argv)
+{
+	struct pollfd pfd[2];
+	struct cmd r;
+	static char lbuf[CMD_BUFSIZE];
+	size_t llen, lineno, pending;
+	ssize_t n;
+	char *nl, *line;
+	int eof, ret;
+
+	optind = 0;
+	if (getopt(argc, argv, "") != -1)
+		cmd_session_usage();
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		cmd_session_usage();
+
+	llen = lineno = pending = 0;
+	eof = ret = 0;
+
+	for (;;) {
+		line = lbuf;
+		while (pending < SESSION_WINDOW &&
+		    (nl = memchr(line, '\n', lbuf + llen - line)) != NULL) {
+			*nl = '\0';
+			lineno++;
+			if (*line != '\0' && *line != '#') {
+				if (session_line(line, lineno) == -1)
+					ret = 1;
+				else
+					pending++;
+			}
+			line = nl + 1;
+		}
+		llen -= line - lbuf;
+		memmove(lbuf, line, llen);
+
+		if (llen == sizeof(lbuf) && memchr(lbuf, '\n', llen) == NULL)
+			errx(1, "line %zu too long", lineno + 1);
+
+		flush_obuf();
+
+		if (eof && llen == 0 && pending == 0)
+			break;
+
+		pfd[0].fd = 0;
+		pfd[0].events = !eof && pending < SESSION_WINDOW ? POLLIN : 0;
+		pfd[1].fd = fd;
+		pfd[1].events = POLLIN;
+
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		if (pfd[1].revents & (POLLIN|POLLHUP)) {
+			if ((n = cmdbuf_read(fd, &ibuf)) == -1)
+				err(1, "read");
+			if (n == 0)
+				errx(1, "connection closed by hirod");
+			while (pending != 0) {
+				switch (recv_cmd(&ibuf, &r)) {
+				case -1:
+					errx(1, "malformed reply");
+				case 1:
+					ret |= print_reply(&r);
+					pending--;
+					continue;
+				}
+				break;
+			}
+			fflush(stdout);
+		}
+
+		/* POLLHUP is reported even when stdin isn't polled */
+		if (pfd[0].events && (pfd[0].revents & (POLLIN|POLLHUP))) {
+			if ((n = read(0, lbuf + llen, sizeof(lbuf) - llen)) == -1)
+				err(1, "read");
+			llen += n;
+			if (n == 0) {
+				eof = 1;
+				/* terminate the last line */
+				if (llen != 0)
+					lbuf[llen++] = '\n';
+			}
+		}
+	}
+
+	return ret;
+}
+
+void dead_attr
+cmd_session_usage(void)
+{
+	fprintf(stderr, "USAGE: %s session < commands\n", me);
+	exit(1);
+}
+
 static int
 open_ctl_sock(const char *path)
 {
@@ -223,7 +748,8 @@ main(int argc, char **argv)
 
 	me = *argv;
 
-	while ((ch = getopt(argc, argv, "P:")) != -1) {
+	/* stop at the first non-option so commands can have flags */
+	while ((ch = getopt(argc, argv, "+P:")) != -1) {
 		switch (ch) {
 		case 'P':
 			sockpath = optarg;
@@ -246,9 +772,6 @@ main(int argc, char **argv)
 
 	sub = argv[0];
 
-	argv++;
-	argc--;
-
 	ret = 1;
 	for (cmd = cmds; cmd->cmd != NULL; ++cmd) {
 		if (!strcmp(sub, cmd->cmd)) {
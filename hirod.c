@@ -16,15 +16,24 @@
 
 #include "cmd.h"
 #include "hiro.h"
+#include "kv.h"
 #include "log.h"
+#include "msg.h"
+#include "overlay.h"
+#include "peer.h"
+#include "pool.h"
+#include "stats.h"
+#include "topic.h"
 #include "util.h"
 
 #include "err.h"
 #include "queue.h"
+#include "strtonum.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include <netinet/in.h>
@@ -32,18 +41,34 @@
 #include <errno.h>
 #include <event.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-typedef void (*cmd_handlefn)(int, struct cmd*);
+struct ctl;
 
-static void	handle_cmd_restart(int, struct cmd*);
-static void	handle_cmd_send(int, struct cmd*);
-static void	handle_cmd_recv(int, struct cmd*);
-static void	handle_cmd_ping(int, struct cmd*);
+/*
+ * A handler returns -1 when the ctl connection was closed or handed
+ * over to something else and no more commands are to be read.
+ */
+typedef int (*cmd_handlefn)(struct ctl*, struct cmd*);
+
+static int	handle_cmd_restart(struct ctl*, struct cmd*);
+static int	handle_cmd_send(struct ctl*, struct cmd*);
+static int	handle_cmd_recv(struct ctl*, struct cmd*);
+static int	handle_cmd_ping(struct ctl*, struct cmd*);
+static int	handle_cmd_send_batch(struct ctl*, struct cmd*);
+static int	handle_cmd_stats(struct ctl*, struct cmd*);
+static int	handle_cmd_forward(struct ctl*, struct cmd*);
+static int	handle_cmd_broadcast(struct ctl*, struct cmd*);
+static int	handle_cmd_kv(struct ctl*, struct cmd*);
+
+static void	ctl_process(struct ctl*);
+static void	close_ctl(struct ctl*);
 
 struct cmd_handlers {
 	enum cmd_type	type;
@@ -53,115 +78,869 @@ struct cmd_handlers {
  	{ CMD_SEND,	handle_cmd_send },
 	{ CMD_RECV,	handle_cmd_recv },
 	{ CMD_PING,	handle_cmd_ping },
+	{ CMD_SEND_BATCH, handle_cmd_send_batch },
+	{ CMD_STATS,	handle_cmd_stats },
+	{ CMD_FORWARD,	handle_cmd_forward },
+	{ CMD_BROADCAST, handle_cmd_broadcast },
+	{ CMD_PUT,	handle_cmd_kv },
+	{ CMD_GET,	handle_cmd_kv },
+	{ CMD_DEL,	handle_cmd_kv },
 	{ -1,		NULL },
 };
 
-LIST_HEAD(clientshead, client) clients;
+/* longest reply to a single command */
+#define CTL_REPLYMAX	4096
+
+/* close idle ctls, and give up on requests, after this many ms */
+#define CTL_IDLEMS	(5 * 60 * 1000)
+#define CTL_WAITMS	(20 * 1000)
+
+/*
+ * A ctl connection.  It carries any number of pipelined commands,
+ * each one gets a reply in out, in order.  While a PUT, GET or DEL
+ * waits for its answer, the commands after it wait too.  The buffers
+ * are taken from ctlbufpool when there's something to put in them
+ * and given back once they're empty, so idle ctls stay small.
+ */
+struct ctl {
+	int			 fd;
+	int			 reading;
+	int			 eof;
+	int			 running;	/* in ctl_process */
+	uint64_t		 wait;		/* reqid of the pending request */
+	LIST_ENTRY(ctl)		 waiting;
+	struct event		 rev;
+	struct event		 wev;
+	struct timer		 timer;		/* idle or waiting */
+	struct cmdbuf		*in;
+	struct cmdbuf		*out;
+};
+
+/* max number of messages written with a single writev */
+#define CLIENT_IOVMAX	64
+
+/* per-client queue limits, see -Q and -B */
+size_t client_maxmsgs = 1024;
+size_t client_maxbytes = 1024 * 1024;
+
+/* drop the clients that don't read anything for this many ms */
+#define CLIENT_STALLMS	(60 * 1000)
+
+/*
+ * Every client is in clients; the ones that didn't ask for specific
+ * topics are in wildcards too and get all the messages.  Clients
+ * belong to the worker that accepted them, so these are per-worker.
+ */
+LIST_HEAD(clientshead, client);
+__thread struct clientshead clients, wildcards;
+__thread struct topics topics;
+
+/* the ctls with a pending request, and the last reqid handed out */
+LIST_HEAD(ctlshead, ctl);
+__thread struct ctlshead waiting;
+__thread uint64_t reqseq;
+
+/* connections accepted on the TCP port per wakeup */
+#define CONN_ACCEPTMAX	16
+
+/*
+ * A connection from another node on the TCP port.  Like the ctl ones,
+ * its buffer comes from ctlbufpool only while a frame is half read.
+ */
+struct conn {
+	int			 fd;
+	struct event		 ev;
+	struct cmdbuf		*in;
+};
+
+/* where the clients, ctl and peer connections of a worker come from */
+__thread struct pool clientpool, ctlpool, ctlbufpool, connpool;
+
+/* the sockets shared by all the workers */
+static int ctlsock;
+static int port;
+
+/* how other nodes reach us, and how to reach the overlay */
+static const char *address = "localhost";
+static const char *joinaddr;
+static char portstr[6];
+
+/* overlays we take part in, and whether GETs race along all of them */
+static int realities = 1;
+static int racegets;
+
+/*
+ * A bunch of messages handed over to the other workers.  Every
+ * worker drops its reference after the delivery to its clients.
+ */
+struct handoff {
+	unsigned int		 rc;
+	size_t			 n;
+	struct msg		*msgs[];
+};
+
 struct client {
 	int			 fd;
-	int			 busy;
-	size_t			 off;
-	size_t			 len;
-	struct shstr		*buf;
-	/* todo: enqueue msgs? */
 	struct event		 ev;
+	struct timer		 stall;		/* while messages are queued */
+
+	/*
+	 * Ring of client_maxmsgs messages waiting to be written.
+	 * off is how much of the first one was already sent.
+	 */
+	size_t			 qhead;
+	size_t			 qlen;
+	size_t			 qbytes;
+	size_t			 off;
+	size_t			 dropped;
+
+	int			 wildcard;
+	LIST_HEAD(, sub)	 subs;
+
 	LIST_ENTRY(client)	 clients;
+	LIST_ENTRY(client)	 wildcards;
+	struct msg		*q[];
 };
 
+/* tell the overlay when a topic gets or loses its subscribers here */
+static void
+topic_interest(const char *to, int on)
+{
+	if (overlay_interest(to, on) == -1)
+		log_warn("the overlay missed that %s %s subscribers", to,
+		    on ? "has" : "lost its");
+}
+
+static void
+free_client(struct client *c)
+{
+	struct sub *s;
+	size_t i;
+
+	while ((s = LIST_FIRST(&c->subs)) != NULL) {
+		LIST_REMOVE(s, entry);
+		if (LIST_FIRST(&s->topic->subs) == s &&
+		    LIST_NEXT(s, subs) == NULL)
+			topic_interest(s->topic->name, 0);
+		topic_unsubscribe(&topics, s);
+	}
+
+	if (c->wildcard)
+		LIST_REMOVE(c, wildcards);
+	LIST_REMOVE(c, clients);
+	stats.clients--;
+	event_del(&c->ev);
+	timer_del(&c->stall);
+	close(c->fd);
+
+	for (i = 0; i < c->qlen; ++i)
+		msg_unref(c->q[(c->qhead + i) % client_maxmsgs]);
+	pool_put(&clientpool, c);
+}
+
+/*
+ * Queue s for c.  When the queue is full the message is dropped for
+ * this client only.
+ */
+static void
+client_enqueue(struct client *c, struct msg *m)
+{
+	if (c->qlen == client_maxmsgs ||
+	    (c->qlen != 0 && c->qbytes + m->len > client_maxbytes)) {
+		stats.dropped++;
+		if (c->dropped++ == 0)
+			log_info("client %d is too slow, dropping messages",
+			    c->fd);
+		return;
+	}
+
+	stats.fanout++;
+	hist_add(&stats.qdepth, c->qlen);
+	c->q[(c->qhead + c->qlen) % client_maxmsgs] = msg_ref(m);
+	c->qlen++;
+	c->qbytes += m->len;
+
+	if (c->qlen == 1) {
+		event_add(&c->ev, NULL);
+		timer_add(&c->stall, CLIENT_STALLMS);
+	}
+}
+
+static void
+client_stalled(void *d)
+{
+	struct client *c = d;
+
+	log_info("client %d didn't read anything for %ds, dropping it",
+	    c->fd, CLIENT_STALLMS / 1000);
+	stats.client_timeouts++;
+	free_client(c);
+}
+
 static void
 handle_client_write(int fd, short ev, void *d)
 {
 	struct client *c = d;
+	struct iovec iov[CLIENT_IOVMAX];
+	struct msg *m;
+	size_t i, n, off, tot;
 	ssize_t r;
 
-	if ((r = write(fd, c->buf->str + c->off, c->len - c->off)) == -1) {
+	stats_busy();
+
+	off = c->off;
+	tot = 0;
+	for (n = 0; n < c->qlen && n < CLIENT_IOVMAX; ++n) {
+		m = c->q[(c->qhead + n) % client_maxmsgs];
+		iov[n].iov_base = m->data + off;
+		iov[n].iov_len = m->len - off;
+		tot += iov[n].iov_len;
+		off = 0;
+	}
+
+	stats.writes++;
+	if ((r = writev(fd, iov, n)) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			stats.write_stalls++;
+			return;
+		}
 		log_debug("failed write for a client, deleting it");
-		LIST_REMOVE(c, clients);
-		free_shstr(c->buf);
-		close(c->fd);
-		event_del(&c->ev);
-		free(c);
+		free_client(c);
 		return;
 	}
 
+	stats.bytes_out += r;
+	if ((size_t)r != tot)
+		stats.write_stalls++;
+
+	for (i = 0; i < n && (size_t)r >= iov[i].iov_len; ++i) {
+		r -= iov[i].iov_len;
+		m = c->q[c->qhead];
+		c->qbytes -= m->len;
+		msg_unref(m);
+		c->qhead = (c->qhead + 1) % client_maxmsgs;
+		c->qlen--;
+		c->off = 0;
+	}
 	c->off += r;
 
-	if (c->off == c->len) {
-		c->busy = 0;
-		free_shstr(c->buf);
-		event_del(&c->ev);
+	/* it's still reading, give it more time */
+	if (c->qlen != 0) {
+		timer_add(&c->stall, CLIENT_STALLMS);
+		return;
+	}
+
+	timer_del(&c->stall);
+	event_del(&c->ev);
+	if (c->dropped != 0) {
+		log_info("client %d caught up, %zu messages dropped",
+		    c->fd, c->dropped);
+		c->dropped = 0;
+	}
+}
+
+/* the buffer in *bp, taken from the pool the first time it's needed */
+static struct cmdbuf *
+ctl_buf(struct cmdbuf **bp)
+{
+	if (*bp == NULL && (*bp = pool_get(&ctlbufpool)) != NULL)
+		(*bp)->off = (*bp)->len = 0;
+	return *bp;
+}
+
+/* give the buffer in *bp back to the pool if there's nothing in it */
+static void
+ctl_buf_trim(struct cmdbuf **bp)
+{
+	if (*bp != NULL && (*bp)->off == (*bp)->len) {
+		pool_put(&ctlbufpool, *bp);
+		*bp = NULL;
+	}
+}
+
+/* how many bytes of replies still fit */
+static size_t
+ctl_room(struct ctl *ctl)
+{
+	if (ctl->out == NULL)
+		return CMD_BUFSIZE;
+	return sizeof(ctl->out->data) - (ctl->out->len - ctl->out->off);
+}
+
+static void
+ctl_reply(struct ctl *ctl, enum cmd_type type, const char *fmt, ...)
+{
+	struct cmd r;
+	va_list ap;
+	char buf[CTL_REPLYMAX];
+
+	memset(&r, 0, sizeof(r));
+	r.type = type;
+
+	if (fmt != NULL) {
+		va_start(ap, fmt);
+		vsnprintf(buf, sizeof(buf), fmt, ap);
+		va_end(ap);
+
+		r.argc = 1;
+		r.argv[0] = buf;
 	}
+
+	/* ctl_process ensures there's always room for a reply */
+	if (ctl_buf(&ctl->out) == NULL || cmd_encode(ctl->out, &r) == -1)
+		log_warn("no space left for a %s reply", cmd_name(type));
+}
+
+static int
+handle_cmd_restart(struct ctl *ctl, struct cmd *cmd)
+{
+	ctl_reply(ctl, CMD_ERROR, "unimplemented handle_cmd_restart");
+	return 0;
 }
 
+/* queue the n messages to the subscribers of the topic `to' */
 static void
-handle_cmd_restart(int fd, struct cmd *cmd)
+fanout(const char *to, struct msg **msgs, size_t n)
+{
+	struct topic *t;
+	struct sub *s;
+	size_t i;
+
+	if ((t = topic_find(&topics, to, strlen(to))) == NULL)
+		return;
+
+	LIST_FOREACH(s, &t->subs, subs) {
+		for (i = 0; i < n; ++i)
+			client_enqueue(s->client, msgs[i]);
+	}
+}
+
+/* the topic is stored after the payload */
+static inline const char *
+msg_topic(struct msg *m)
+{
+	return m->data + m->len;
+}
+
+/*
+ * Make a message for the topic to out of the len bytes of payload
+ * in p.  Subscribers get one message per line.
+ */
+static struct msg *
+make_msg(const char *to, const char *p, size_t len)
 {
-	dprintf(fd, "unimplemented handle_cmd_restart\n");
-	close(fd);
+	struct msg *m;
+	size_t tolen;
+
+	tolen = strlen(to);
+	if ((m = msg_alloc(len + 1 + tolen + 1)) == NULL)
+		return NULL;
+	memcpy(m->data, p, len);
+	m->data[len] = '\n';
+	memcpy(m->data + len + 1, to, tolen + 1);
+	m->len = len + 1;
+	return m;
 }
 
+/* queue the n messages to the clients of this worker */
 static void
-handle_cmd_send(int fd, struct cmd *cmd)
+deliver(struct msg **msgs, size_t n)
 {
 	struct client *c;
-	struct shstr *s;
+	size_t i, run;
+
+	/* one pass over the subscribers per run of the same topic */
+	for (run = 0, i = 1; i <= n; ++i) {
+		if (i == n ||
+		    strcmp(msg_topic(msgs[run]), msg_topic(msgs[i])) != 0) {
+			fanout(msg_topic(msgs[run]), msgs + run, i - run);
+			run = i;
+		}
+	}
+
+	LIST_FOREACH(c, &wildcards, wildcards) {
+		for (i = 0; i < n; ++i)
+			client_enqueue(c, msgs[i]);
+	}
+}
+
+static void
+handoff_unref(struct handoff *h)
+{
+	size_t i;
+
+	if (__atomic_sub_fetch(&h->rc, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	for (i = 0; i < h->n; ++i)
+		msg_unref(h->msgs[i]);
+	free(h);
+}
+
+static void
+handle_handoff(void *d)
+{
+	struct handoff *h = d;
+
+	deliver(h->msgs, h->n);
+	handoff_unref(h);
+}
+
+/*
+ * Deliver the messages to our clients and hand them over to the
+ * other workers.  A worker with a full ring gets them once it makes
+ * room; it only misses them if we run out of memory.
+ */
+static void
+publish(struct msg **msgs, size_t n)
+{
+	struct handoff *h;
+	size_t i;
+	int j;
+
+	deliver(msgs, n);
+
+	if (nworkers == 1 || n == 0)
+		return;
+
+	if ((h = malloc(sizeof(*h) + n * sizeof(*h->msgs))) == NULL) {
+		log_warn("publish: failed malloc");
+		stats.handoff_drops += n * (nworkers - 1);
+		return;
+	}
+	h->rc = nworkers;
+	h->n = n;
+	for (i = 0; i < n; ++i)
+		h->msgs[i] = msg_ref(msgs[i]);
+
+	for (j = 0; j < nworkers; ++j) {
+		if (&workers[j] == worker)
+			continue;
+
+		if (worker_post(&workers[j], handle_handoff, h) == -1) {
+			stats.handoff_drops += n;
+			handoff_unref(h);
+			continue;
+		}
+		stats.handoffs += n;
+		worker_kick(&workers[j]);
+	}
+
+	handoff_unref(h);
+}
+
+/* publish a message that came through the overlay */
+int
+publish_msg(const char *to, const char *p, size_t len)
+{
+	struct msg *m;
+
+	if ((m = make_msg(to, p, len)) == NULL) {
+		log_warn("failed allocation of struct msg");
+		return -1;
+	}
+	stats.published++;
+
+	publish(&m, 1);
+	msg_unref(m);
+	return 0;
+}
+
+static int
+handle_cmd_send(struct ctl *ctl, struct cmd *cmd)
+{
+	struct msg *m;
+	size_t len;
 
 	if (cmd->argc != 2) {
 		log_warn("SEND command with improper arg number (%d)",
 		    cmd->argc);
-		goto end;
+		ctl_reply(ctl, CMD_ERROR, "wrong number of arguments");
+		return 0;
 	}
 
-	if ((s = make_shstr(cmd->argv[1])) == NULL) {
-		log_warn("failed allocation of struct shstr");
-		goto end;
+	/* the payload is the last argument, its length is known */
+	len = cmd->data + cmd->len - cmd->argv[1] - 1;
+
+	if ((m = make_msg(cmd->argv[0], cmd->argv[1], len)) == NULL) {
+		log_warn("failed allocation of struct msg");
+		ctl_reply(ctl, CMD_ERROR, "out of memory");
+		return 0;
 	}
+	stats.published++;
 
-	log_warn("TODO: send %s to %s",
-	    cmd->argv[1], cmd->argv[0]);
+	publish(&m, 1);
+	msg_unref(m);
 
-	LIST_FOREACH(c, &clients, clients) {
-		/* XXX: enqueue? */
-		if (c->busy)
-			continue;
+	/* and to the subscribers on the other nodes */
+	if (overlay_publish(cmd) == -1)
+		log_warn("the overlay missed a SEND");
 
-		c->len = strlen(s->str);
-		c->off = 0;
-		c->buf = shstr_inc(s);
-		event_set(&c->ev, c->fd, EV_WRITE | EV_PERSIST, handle_client_write, c);
-		event_add(&c->ev, NULL);
+	ctl_reply(ctl, CMD_OK, NULL);
+	return 0;
+}
+
+/*
+ * The frame holds argc/2 (to, payload) pairs: build all the messages
+ * first, then publish them at once so that every run of messages
+ * with the same destination takes a single pass over the subscribers
+ * of that topic.
+ */
+static int
+handle_cmd_send_batch(struct ctl *ctl, struct cmd *cmd)
+{
+	static __thread struct msg *batch[CMD_MAXLEN / 2];
+	size_t i, n, len;
+	char *p, *to;
+
+	if (cmd->argc % 2 != 0) {
+		log_warn("SEND_BATCH command with odd arg number (%d)",
+		    cmd->argc);
+		ctl_reply(ctl, CMD_ERROR, "wrong number of arguments");
+		return 0;
+	}
+
+	n = 0;
+	for (p = cmd->data; p != cmd->data + cmd->len; p += len + 1) {
+		to = p;
+		p += strlen(p) + 1;
+		len = strlen(p);
+
+		if ((batch[n] = make_msg(to, p, len)) == NULL) {
+			log_warn("failed allocation of struct msg");
+			break;
+		}
+		n++;
+		stats.published++;
+
+	}
+
+	publish(batch, n);
+
+	for (i = 0; i < n; ++i)
+		msg_unref(batch[i]);
+
+	if (n == (size_t)cmd->argc / 2 && overlay_publish(cmd) == -1)
+		log_warn("the overlay missed a SEND_BATCH");
+
+	if (n != (size_t)cmd->argc / 2)
+		ctl_reply(ctl, CMD_ERROR, "out of memory");
+	else
+		ctl_reply(ctl, CMD_OK, NULL);
+	return 0;
+}
+
+/*
+ * The totals of all the workers.  The other workers keep updating
+ * their counters meanwhile, so they're only approximate.
+ */
+static int
+handle_cmd_stats(struct ctl *ctl, struct cmd *cmd)
+{
+	struct stats tot;
+	char buf[CTL_REPLYMAX];
+	int i;
+
+	memset(&tot, 0, sizeof(tot));
+	for (i = 0; i < nworkers; ++i) {
+		if (workers[i].stats != NULL)
+			stats_sum(&tot, workers[i].stats);
+	}
+
+	if (stats_print(buf, sizeof(buf), &tot, nworkers) == -1)
+		log_warn("stats truncated");
+
+	ctl_reply(ctl, CMD_OK, "%s", buf);
+	return 0;
+}
+
+/* inject a FORWARD frame into the overlay: point... to payload */
+static int
+handle_cmd_forward(struct ctl *ctl, struct cmd *cmd)
+{
+	if (overlay_forward(cmd) == -1)
+		ctl_reply(ctl, CMD_ERROR, "malformed forward");
+	else
+		ctl_reply(ctl, CMD_OK, NULL);
+	return 0;
+}
+
+/* a SEND to the subscribers on every node: to payload */
+static int
+handle_cmd_broadcast(struct ctl *ctl, struct cmd *cmd)
+{
+	if (cmd->argc != 2) {
+		ctl_reply(ctl, CMD_ERROR, "wrong number of arguments");
+		return 0;
+	}
+
+	if (overlay_broadcast(cmd->argv[0], cmd->argv[1]) == -1)
+		ctl_reply(ctl, CMD_ERROR, "out of memory");
+	else
+		ctl_reply(ctl, CMD_OK, NULL);
+	return 0;
+}
+
+/*
+ * PUT key value, GET key and DEL key.  The request goes to worker 0
+ * and maybe to another node: ctl_process stops until kv_answer.
+ * The low 16 bits of the reqid are the worker the ctl belongs to.
+ */
+static int
+handle_cmd_kv(struct ctl *ctl, struct cmd *cmd)
+{
+	int argc;
+
+	argc = cmd->type == CMD_PUT ? 2 : 1;
+	if (cmd->argc != argc) {
+		ctl_reply(ctl, CMD_ERROR, "wrong number of arguments");
+		return 0;
+	}
+
+	if (*cmd->argv[0] == '\0' || strlen(cmd->argv[0]) > KV_MAXKEY) {
+		ctl_reply(ctl, CMD_ERROR, "bad key");
+		return 0;
 	}
+	if (argc == 2 && strlen(cmd->argv[1]) > KV_MAXVALUE) {
+		ctl_reply(ctl, CMD_ERROR, "value too long");
+		return 0;
+	}
+
+	ctl->wait = ++reqseq << 16 | worker->id;
+	LIST_INSERT_HEAD(&waiting, ctl, waiting);
+	timer_add(&ctl->timer, CTL_WAITMS);
 
-end:
-	close(fd);
+	if (overlay_kv(cmd->type, cmd->argv[0], argc == 2 ? cmd->argv[1] :
+	    NULL, ctl->wait) == -1) {
+		LIST_REMOVE(ctl, waiting);
+		ctl->wait = 0;
+		timer_add(&ctl->timer, CTL_IDLEMS);
+		ctl_reply(ctl, CMD_ERROR, "out of memory");
+	}
+	return 0;
 }
 
+/* an answer for a ctl of this worker */
+struct answer {
+	uint64_t	 reqid;
+	enum cmd_type	 status;
+	int		 hasvalue;
+	char		 value[];
+};
+
 static void
-handle_cmd_recv(int fd, struct cmd *cmd)
+ctl_answered(struct ctl *ctl, enum cmd_type status, const char *v)
 {
-	struct client *c;
+	LIST_REMOVE(ctl, waiting);
+	ctl->wait = 0;
+	timer_add(&ctl->timer, CTL_IDLEMS);
+	if (v != NULL)
+		ctl_reply(ctl, status, "%s", v);
+	else
+		ctl_reply(ctl, status, NULL);
+
+	/* resume the commands, unless it was answered from within them */
+	if (!ctl->running)
+		ctl_process(ctl);
+}
+
+static void
+ctl_answer(uint64_t reqid, enum cmd_type status, const char *v)
+{
+	struct ctl *ctl;
+
+	LIST_FOREACH(ctl, &waiting, waiting)
+		if (ctl->wait == reqid)
+			break;
+	if (ctl == NULL)
+		return;		/* it went away, or timed out */
+
+	ctl_answered(ctl, status, v);
+}
+
+/* the ctl did nothing for too long, or its request got no answer */
+static void
+ctl_timeout(void *d)
+{
+	struct ctl *ctl = d;
 
-	if ((c = calloc(1, sizeof(*c))) == NULL) {
-		log_warn("handle_cmd_recv: failed calloc");
-		close(fd);
+	stats.ctl_timeouts++;
+	if (ctl->wait != 0) {
+		ctl_answered(ctl, CMD_ERROR, "timed out");
 		return;
 	}
 
-	c->fd = fd;
-	LIST_INSERT_HEAD(&clients, c, clients);
+	log_info("closing a ctl connection idle for %ds", CTL_IDLEMS / 1000);
+	close_ctl(ctl);
+}
+
+static void
+handle_answer(void *d)
+{
+	struct answer *a = d;
+
+	ctl_answer(a->reqid, a->status, a->hasvalue ? a->value : NULL);
+	free(a);
+}
+
+/* called by worker 0 with the outcome of a request */
+void
+kv_answer(uint64_t reqid, enum cmd_type status, const char *v)
+{
+	struct answer *a;
+	size_t len;
+	int id;
+
+	id = reqid & 0xffff;
+	if (id == worker->id) {
+		ctl_answer(reqid, status, v);
+		return;
+	}
+	if (id >= nworkers) {
+		log_warn("answer for an unknown worker %d", id);
+		return;
+	}
+
+	len = v != NULL ? strlen(v) + 1 : 0;
+	if ((a = malloc(sizeof(*a) + len)) == NULL) {
+		log_warn("kv_answer: malloc");
+		return;
+	}
+	a->reqid = reqid;
+	a->status = status;
+	a->hasvalue = v != NULL;
+	if (v != NULL)
+		memcpy(a->value, v, len);
+
+	if (worker_post(&workers[id], handle_answer, a) == -1) {
+		log_warn("kv_answer: worker_post");
+		stats.handoff_drops++;
+		free(a);
+		return;
+	}
+	worker_kick(&workers[id]);
 }
 
 static void
-handle_cmd_ping(int fd, struct cmd *cmd)
+free_ctl(struct ctl *ctl)
+{
+	stats.ctls--;
+	if (ctl->wait != 0)
+		LIST_REMOVE(ctl, waiting);
+	event_del(&ctl->rev);
+	event_del(&ctl->wev);
+	timer_del(&ctl->timer);
+	if (ctl->in != NULL)
+		pool_put(&ctlbufpool, ctl->in);
+	if (ctl->out != NULL)
+		pool_put(&ctlbufpool, ctl->out);
+	pool_put(&ctlpool, ctl);
+}
+
+static void
+close_ctl(struct ctl *ctl)
+{
+	close(ctl->fd);
+	free_ctl(ctl);
+}
+
+/* whether c is already among the subscribers of the topic */
+static int
+client_subscribed(struct client *c, const char *name, size_t len)
+{
+	struct sub *s;
+
+	LIST_FOREACH(s, &c->subs, entry)
+		if (s->topic->len == len && !memcmp(s->topic->name, name, len))
+			return 1;
+	return 0;
+}
+
+/*
+ * The connection becomes a subscriber of the topics in the args, or
+ * of everything if there are none.  The replies still pending, this
+ * one included, are queued as its first message.
+ */
+static int
+handle_cmd_recv(struct ctl *ctl, struct cmd *cmd)
+{
+	struct client *c;
+	struct sub *s;
+	struct msg *m;
+	size_t len;
+	char *p;
+
+	if (ctl->in->off != ctl->in->len)
+		log_info("ignoring commands after RECV");
+
+	if ((c = pool_get(&clientpool)) == NULL) {
+		log_warn("handle_cmd_recv: failed pool_get");
+		close_ctl(ctl);
+		return -1;
+	}
+	memset(c, 0, sizeof(*c));
+
+	c->fd = ctl->fd;
+	worker_event_set(&c->ev, c->fd, EV_WRITE | EV_PERSIST,
+	    handle_client_write, c);
+	timer_set(&c->stall, client_stalled, c);
+	LIST_INIT(&c->subs);
+	LIST_INSERT_HEAD(&clients, c, clients);
+	stats.clients++;
+
+	if (cmd->argc == 0) {
+		c->wildcard = 1;
+		LIST_INSERT_HEAD(&wildcards, c, wildcards);
+	}
+
+	for (p = cmd->data; p != cmd->data + cmd->len; p += len + 1) {
+		len = strlen(p);
+		if (client_subscribed(c, p, len))
+			continue;
+		if ((s = topic_subscribe(&topics, p, len, c)) == NULL) {
+			log_warn("handle_cmd_recv: failed topic_subscribe");
+			free_client(c);
+			free_ctl(ctl);
+			return -1;
+		}
+		LIST_INSERT_HEAD(&c->subs, s, entry);
+		if (LIST_NEXT(s, subs) == NULL)
+			topic_interest(p, 1);
+	}
+
+	/* the reply is the only thing in out, if it could be made */
+	ctl_reply(ctl, CMD_OK, NULL);
+	len = ctl->out != NULL ? ctl->out->len - ctl->out->off : 0;
+
+	if (len == 0 || (m = msg_alloc(len)) == NULL) {
+		log_warn("handle_cmd_recv: failed allocation");
+		free_client(c);
+		free_ctl(ctl);
+		return -1;
+	}
+	memcpy(m->data, ctl->out->data + ctl->out->off, len);
+
+	client_enqueue(c, m);
+	msg_unref(m);
+
+	free_ctl(ctl);
+	return -1;
+}
+
+static int
+handle_cmd_ping(struct ctl *ctl, struct cmd *cmd)
 {
-	dprintf(fd, "PONG\n");
-	close(fd);
+	ctl_reply(ctl, CMD_OK, "PONG");
+	return 0;
 }
 
 static void
 usage(const char *me)
 {
-	fprintf(stderr, "USAGE: %s [-P sock_path] [-p port]\n",
+	fprintf(stderr, "USAGE: %s [-x] [-a address] [-B maxbytes] "
+	    "[-J host:port] [-j workers]\n"
+	    "          [-L linger] [-P sock_path] [-p port] [-Q maxmsgs]\n"
+	    "          [-R realities] [-T flushbytes]\n",
 	    me);
 }
 
@@ -209,7 +988,8 @@ make_socket(int port, int family)
 	if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &v, sizeof(v)) == -1)
 		err(1, "setsockopt(SO_REUSEPORT)");
 
-	/* mark_nonblock(sock); */
+	if (mark_nonblock(sock) == -1)
+		err(1, "mark_nonblock");
 
 	if (bind(sock, addr, len) == -1)
 		err(1, "bind");
@@ -240,117 +1020,483 @@ make_ctl_socket(const char *path)
 	if (listen(fd, 5) == -1)
 		err(1, "listen");
 
+	if (mark_nonblock(fd) == -1)
+		err(1, "mark_nonblock");
+
 	return fd;
 }
 
-static void
-handle_cmd(int fd, short events, void *d)
+static int
+handle_cmd(struct ctl *ctl, struct cmd *cmd)
 {
-	struct cmd cmd;
 	struct cmd_handlers *hs;
 
-	if (recv_cmd(fd, &cmd) == -1) {
-		log_warn("failed recv_cmd");
+	log_debug("got command: %s", cmd_name(cmd->type));
+
+	if (cmd->type < STATS_NCMDS)
+		stats.cmds[cmd->type]++;
+
+	for (hs = handlers; hs->fn != NULL; ++hs) {
+		if (hs->type == cmd->type)
+			return hs->fn(ctl, cmd);
+	}
+
+	log_warn("unknown command %d", cmd->type);
+	ctl_reply(ctl, CMD_ERROR, "unknown command");
+	return 0;
+}
+
+static void
+ctl_flush(struct ctl *ctl)
+{
+	ssize_t r = 0;
+
+	if (ctl->out != NULL && ctl->out->off != ctl->out->len) {
+		r = cmdbuf_write(ctl->fd, ctl->out);
+		if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR) {
+			log_warn("write to ctl connection: %s",
+			    strerror(errno));
+			close_ctl(ctl);
+			return;
+		}
+	}
+	ctl_buf_trim(&ctl->out);
+
+	if (ctl->out == NULL) {
+		if (ctl->eof && ctl->wait == 0) {
+			close_ctl(ctl);
+			return;
+		}
+		event_del(&ctl->wev);
+	} else
+		event_add(&ctl->wev, NULL);
+
+	/*
+	 * the commands left in the input buffer won't be woken up by
+	 * a read: the client waits for their replies first
+	 */
+	if (!ctl->running && r > 0 && ctl->wait == 0 &&
+	    ctl->in != NULL && ctl->in->off != ctl->in->len &&
+	    ctl_room(ctl) >= CTL_REPLYMAX + sizeof(struct cmd_hdr)) {
+		ctl_process(ctl);
 		return;
 	}
+	ctl_buf_trim(&ctl->in);
+
+	/*
+	 * stop reading while the client doesn't get its replies or
+	 * waits for an answer
+	 */
+	if (ctl->wait != 0 ||
+	    ctl_room(ctl) < CTL_REPLYMAX + sizeof(struct cmd_hdr)) {
+		if (ctl->reading)
+			event_del(&ctl->rev);
+		ctl->reading = 0;
+	} else if (!ctl->reading && !ctl->eof && (ctl->in == NULL ||
+	    ctl->in->len - ctl->in->off < sizeof(ctl->in->data))) {
+		event_add(&ctl->rev, NULL);
+		ctl->reading = 1;
+	}
+}
 
-	log_debug("got command: %s", cmd_name(cmd.type));
+/* run the commands in the input buffer as long as replies fit */
+static void
+ctl_process(struct ctl *ctl)
+{
+	struct cmd cmd;
 
-	for (hs = handlers; hs->fn != NULL; ++hs) {
-		if (hs->type == cmd.type) {
-			hs->fn(fd, &cmd);
-			goto end;
+	ctl->running = 1;
+	while (ctl->in != NULL && ctl->wait == 0 &&
+	    ctl_room(ctl) >= CTL_REPLYMAX + sizeof(struct cmd_hdr)) {
+		switch (recv_cmd(ctl->in, &cmd)) {
+		case 0:
+			goto flush;
+		case -1:
+			log_warn("malformed command on the ctl socket");
+			close_ctl(ctl);
+			return;
+		}
+
+		if (handle_cmd(ctl, &cmd) == -1)
+			return;
+	}
+
+flush:
+	ctl->running = 0;
+	ctl_flush(ctl);
+}
+
+static void
+handle_ctl_read(int fd, short events, void *d)
+{
+	struct ctl *ctl = d;
+	ssize_t r;
+
+	stats_busy();
+
+	if (ctl_buf(&ctl->in) == NULL) {
+		log_warn("handle_ctl_read: failed pool_get");
+		close_ctl(ctl);
+		return;
+	}
+
+	if ((r = cmdbuf_read(fd, ctl->in)) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			ctl_buf_trim(&ctl->in);
+			return;
+		}
+		if (errno == ENOBUFS) {
+			/* the commands in there have to run first */
+			event_del(&ctl->rev);
+			ctl->reading = 0;
+			ctl_process(ctl);
+			return;
 		}
+		log_warn("read from ctl connection: %s", strerror(errno));
+		close_ctl(ctl);
+		return;
+	}
+
+	if (ctl->wait == 0)
+		timer_add(&ctl->timer, CTL_IDLEMS);
+
+	if (r == 0) {
+		/* still deliver the replies to what was already read */
+		ctl->eof = 1;
+		event_del(&ctl->rev);
+		ctl->reading = 0;
 	}
 
-	warnx("unknown command %d", cmd.type);
-	close(fd);
+	ctl_process(ctl);
+}
 
-end:
-	if (cmd.argv != 0)
-		free(cmd.argv[0]);
+static void
+handle_ctl_write(int fd, short events, void *d)
+{
+	stats_busy();
+	ctl_process(d);
 }
 
 static void
 handle_ctl_conn(int fd, short events, void *d)
 {
+	struct ctl *ctl;
 	int cfd;
 
+	stats_busy();
+
 	if ((cfd = accept(fd, NULL, NULL)) == -1) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK)
 			return;
 		err(1, "accept");
 	}
 
-	event_once(cfd, EV_READ, handle_cmd, NULL, NULL);
+	if (mark_nonblock(cfd) == -1) {
+		log_warn("mark_nonblock: %s", strerror(errno));
+		close(cfd);
+		return;
+	}
+
+	if ((ctl = pool_get(&ctlpool)) == NULL) {
+		log_warn("handle_ctl_conn: failed pool_get");
+		close(cfd);
+		return;
+	}
+
+	stats.ctls++;
+	ctl->fd = cfd;
+	ctl->reading = 1;
+	ctl->eof = 0;
+	ctl->running = 0;
+	ctl->wait = 0;
+	ctl->in = NULL;
+	ctl->out = NULL;
+	worker_event_set(&ctl->rev, cfd, EV_READ | EV_PERSIST,
+	    handle_ctl_read, ctl);
+	worker_event_set(&ctl->wev, cfd, EV_WRITE | EV_PERSIST,
+	    handle_ctl_write, ctl);
+	event_add(&ctl->rev, NULL);
+	timer_set(&ctl->timer, ctl_timeout, ctl);
+	timer_add(&ctl->timer, CTL_IDLEMS);
+}
+
+static void
+close_conn(struct conn *c)
+{
+	event_del(&c->ev);
+	close(c->fd);
+	if (c->in != NULL)
+		pool_put(&ctlbufpool, c->in);
+	pool_put(&connpool, c);
+}
+
+/* every frame from another node is for the overlay */
+static void
+handle_conn_read(int fd, short events, void *d)
+{
+	struct conn *c = d;
+	struct wire w;
+	ssize_t r;
+
+	stats_busy();
+
+	if (ctl_buf(&c->in) == NULL) {
+		log_warn("handle_conn_read: failed pool_get");
+		close_conn(c);
+		return;
+	}
+
+	if ((r = cmdbuf_read(fd, c->in)) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			ctl_buf_trim(&c->in);
+			return;
+		}
+		log_warn("read from peer: %s", strerror(errno));
+		close_conn(c);
+		return;
+	}
+
+	for (;;) {
+		switch (wire_recv(c->in, &w)) {
+		case 1:
+			overlay_post(&w);
+			continue;
+		case -1:
+			log_warn("malformed frame from a peer");
+			close_conn(c);
+			return;
+		}
+		break;
+	}
+
+	if (r == 0)
+		close_conn(c);
+	else
+		ctl_buf_trim(&c->in);
+}
+
+/* returns -1 when there's nothing left to accept */
+static int
+accept_conn(int fd)
+{
+	struct conn *c;
+	int cfd;
+
+	if ((cfd = accept(fd, NULL, NULL)) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			log_warn("accept: %s", strerror(errno));
+		return -1;
+	}
+
+	if (mark_nonblock(cfd) == -1) {
+		log_warn("mark_nonblock: %s", strerror(errno));
+		close(cfd);
+		return 0;
+	}
+
+	if ((c = pool_get(&connpool)) == NULL) {
+		log_warn("handle_conn: failed pool_get");
+		close(cfd);
+		return 0;
+	}
+
+	c->fd = cfd;
+	c->in = NULL;
+	worker_event_set(&c->ev, cfd, EV_READ | EV_PERSIST,
+	    handle_conn_read, c);
+	event_add(&c->ev, NULL);
+	return 0;
 }
 
+/*
+ * The listener is non-blocking: take what's in the backlog, but no
+ * more than CONN_ACCEPTMAX at a time so the other events get a turn.
+ */
 static void
 handle_conn(int fd, short events, void *d)
 {
-	puts("got a connection on the socket!");
-	return;
+	int i;
+
+	stats_busy();
+
+	for (i = 0; i < CONN_ACCEPTMAX; ++i)
+		if (accept_conn(fd) == -1)
+			break;
+}
+
+static void
+left_overlay(void)
+{
+	log_info("bye");
+	exit(0);
+}
+
+/*
+ * SIGTERM or SIGINT, handled by worker 0: leave the overlay first,
+ * unless it's the second one.
+ */
+static void
+handle_signal(int sig, short ev, void *d)
+{
+	static int leaving;
+
+	stats_busy();
+
+	if (leaving++)
+		exit(1);
+	log_info("leaving the overlay");
+	overlay_leave(left_overlay);
+}
+
+/*
+ * Runs on every worker: the ctl socket is shared, while every worker
+ * has its own listener on the port and the kernel spreads the
+ * connections between them.
+ */
+static void
+worker_init(struct worker *w)
+{
+	static __thread struct event ctlev, sockev, termev, intev;
+	int sock;
+
+	LIST_INIT(&clients);
+	LIST_INIT(&wildcards);
+	LIST_INIT(&waiting);
+	if (topics_init(&topics) == -1)
+		err(1, "topics_init");
+
+	if (pool_init(&clientpool, "client", sizeof(struct client) +
+	    client_maxmsgs * sizeof(struct msg *)) == -1 ||
+	    pool_init(&ctlpool, "ctl", sizeof(struct ctl)) == -1 ||
+	    pool_init(&ctlbufpool, "ctlbuf", sizeof(struct cmdbuf)) == -1 ||
+	    pool_init(&connpool, "conn", sizeof(struct conn)) == -1)
+		err(1, "pool_init");
+
+	worker_event_set(&ctlev, ctlsock, EV_READ | EV_PERSIST,
+	    &handle_ctl_conn, NULL);
+	event_add(&ctlev, NULL);
+
+	if ((sock = make_socket(port, AF_INET)) == -1)
+		err(1, "make_socket");
+
+	worker_event_set(&sockev, sock, EV_READ | EV_PERSIST,
+	    &handle_conn, NULL);
+	event_add(&sockev, NULL);
+
+	if (w->id == 0) {
+		(void)snprintf(portstr, sizeof(portstr), "%d", port);
+		overlay_init(address, portstr, joinaddr, realities,
+		    racegets);
+
+		worker_event_set(&termev, SIGTERM, EV_SIGNAL | EV_PERSIST,
+		    handle_signal, NULL);
+		event_add(&termev, NULL);
+		worker_event_set(&intev, SIGINT, EV_SIGNAL | EV_PERSIST,
+		    handle_signal, NULL);
+		event_add(&intev, NULL);
+	}
+
+	log_debug("worker %d ready", w->id);
 }
 
 int
 main(int argc, char **argv) 
 {
-	struct event ctlev, sockev;
-	int ch, port, ctl, sock;
-	const char *path;
+	int ch, n;
+	long ncpu;
+	const char *path, *errstr;
 
 	port = 2103;
 	path = NULL;
+	n = 1;
 
 	signal(SIGPIPE, SIG_IGN);
 
-	while ((ch = getopt(argc, argv, "P:p:v")) != -1) {
+	while ((ch = getopt(argc, argv, "a:B:J:j:L:P:p:Q:R:T:vx")) != -1) {
 		switch (ch) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'B':
+			client_maxbytes = strtonum(optarg, 1, SSIZE_MAX,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "max bytes per client is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'J':
+			joinaddr = optarg;
+			break;
+		case 'j':
+			n = strtonum(optarg, 0, 1024, &errstr);
+			if (errstr != NULL)
+				errx(1, "number of workers is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'L':
+			peer_linger = strtonum(optarg, 0, 999999, &errstr);
+			if (errstr != NULL)
+				errx(1, "linger is %s: %s", errstr, optarg);
+			break;
 		case 'p':
 			port = parse_portno(optarg);
 			break;
 		case 'P':
 			path = optarg;
 			break;
+		case 'Q':
+			client_maxmsgs = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "max messages per client is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'R':
+			realities = strtonum(optarg, 1, OVERLAY_MAXREALITIES,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "number of realities is %s: %s",
+				    errstr, optarg);
+			break;
+		case 'T':
+			peer_flushbytes = strtonum(optarg, 1, CMD_BUFSIZE,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "flush threshold is %s: %s", errstr,
+				    optarg);
+			break;
 		case 'v':
 			verbose++;
 			break;
+		case 'x':
+			racegets = 1;
+			break;
 		default:
 			usage(*argv);
 			return 1;
 		}
 	}
 
-	/* XXX: temporary */
-	verbose = 3;
-
-	LIST_INIT(&clients);
+	/* -j 0 means one worker per core */
+	if (n == 0) {
+		if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) == -1)
+			err(1, "sysconf");
+		n = ncpu;
+	}
 
 	if (path == NULL)
 		path = default_socket_path();
 
-	if ((ctl = make_ctl_socket(path)) == -1)
+	if ((ctlsock = make_ctl_socket(path)) == -1)
 		err(1, "make_ctl_socket");
 
-	if ((sock = make_socket(port, AF_INET)) == -1)
-		err(1, "make_socket");
-
-	log_debug("starting...");
-
-	event_init();
-
-	event_set(&ctlev, ctl, EV_READ | EV_PERSIST, &handle_ctl_conn, NULL);
-	event_add(&ctlev, NULL);
-	log_debug("ready to accept commands over the ctl socket");
-
-	event_set(&sockev, sock, EV_READ | EV_PERSIST, &handle_conn, NULL);
-	event_add(&sockev, NULL);
-	log_debug("ready to accept network connections");
+	log_debug("starting %d workers...", n);
 
-	event_dispatch();
+	if (workers_init(n, worker_init) == -1)
+		err(1, "workers_init");
+	workers_run();
 
-	close(ctl);
-	close(sock);
+	close(ctlsock);
 
 	return 0;
 }
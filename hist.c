@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "hist.h"
+
+#define HIST_SUB	(1U << HIST_SUBBITS)
+
+static inline unsigned int
+bucket_of(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < HIST_SUB)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	return ((e - HIST_SUBBITS + 1) << HIST_SUBBITS) +
+	    ((v >> (e - HIST_SUBBITS)) & (HIST_SUB - 1));
+}
+
+/* the highest value that falls in bucket i */
+static inline uint64_t
+bucket_max(unsigned int i)
+{
+	unsigned int e;
+	uint64_t lo;
+
+	if (i < HIST_SUB)
+		return i;
+
+	e = (i >> HIST_SUBBITS) + HIST_SUBBITS - 1;
+	lo = (uint64_t)(HIST_SUB | (i & (HIST_SUB - 1))) << (e - HIST_SUBBITS);
+	return lo + ((uint64_t)1 << (e - HIST_SUBBITS)) - 1;
+}
+
+void
+hist_add(struct hist *h, uint64_t v)
+{
+	h->buckets[bucket_of(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+void
+hist_merge(struct hist *h, const struct hist *o)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_NBUCKETS; ++i)
+		h->buckets[i] += o->buckets[i];
+	h->count += o->count;
+	h->sum += o->sum;
+	if (o->max > h->max)
+		h->max = o->max;
+}
+
+/*
+ * Return an upper bound of the q-th quantile (0 <= q <= 1), never
+ * more than the biggest value recorded.
+ */
+uint64_t
+hist_quantile(const struct hist *h, double q)
+{
+	uint64_t n, seen, v;
+	unsigned int i;
+
+	if (h->count == 0)
+		return 0;
+
+	n = q * h->count;
+	if (n == 0)
+		n = 1;
+
+	seen = 0;
+	for (i = 0; i < HIST_NBUCKETS; ++i) {
+		seen += h->buckets[i];
+		if (seen >= n)
+			break;
+	}
+
+	v = bucket_max(i < HIST_NBUCKETS ? i : HIST_NBUCKETS - 1);
+	return v < h->max ? v : h->max;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_HIST_H
+#define HIRO_HIST_H
+
+#include <stdint.h>
+
+/*
+ * Log-bucketed histogram: every power of two is split in 2^HIST_SUBBITS
+ * linear buckets, so a value is recorded with an error of at most
+ * 1/2^HIST_SUBBITS.
+ */
+#define HIST_SUBBITS	3
+#define HIST_NBUCKETS	((64 - HIST_SUBBITS + 1) << HIST_SUBBITS)
+
+struct hist {
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	max;
+	uint64_t	buckets[HIST_NBUCKETS];
+};
+
+void		 hist_add(struct hist*, uint64_t);
+void		 hist_merge(struct hist*, const struct hist*);
+uint64_t	 hist_quantile(const struct hist*, double);
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "can.h"
+#include "key.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The hash eats 16 bytes at a time folding them with a 64x64->128
+ * multiplication, in the spirit of wyhash.  The coordinates of the
+ * point are then drawn from it with the splitmix64 finalizer.
+ */
+
+#define K0	0xa0761d6478bd642fULL
+#define K1	0xe7037ed1a0b428dbULL
+#define K2	0x8ebc6af09c88c6e3ULL
+#define K3	0x589965cc75374cc3ULL
+#define GAMMA	0x9e3779b97f4a7c15ULL
+
+/* the two halves of a * b xored together */
+static inline uint64_t
+mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t)a * b;
+
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+	uint64_t ah = a >> 32, al = (uint32_t)a;
+	uint64_t bh = b >> 32, bl = (uint32_t)b;
+	uint64_t hh = ah * bh, hl = ah * bl, lh = al * bh, ll = al * bl;
+	uint64_t mid, lo, hi;
+
+	mid = (ll >> 32) + (uint32_t)hl + (uint32_t)lh;
+	lo = (mid << 32) | (uint32_t)ll;
+	hi = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+	return lo ^ hi;
+#endif
+}
+
+/* little-endian loads, so that every node gets the same points */
+static inline uint64_t
+load64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint64_t
+load32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline uint64_t
+hash_start(size_t len)
+{
+	return K0 ^ mum(len ^ K1, K0);
+}
+
+static inline uint64_t
+hash_block(uint64_t h, const unsigned char *p)
+{
+	return mum(load64(p) ^ K1, load64(p + 8) ^ h);
+}
+
+/*
+ * The bytes of a key that hash_finish folds block by block before
+ * the last (possibly overlapping) 16 bytes.
+ */
+static inline size_t
+hash_blocks(size_t len)
+{
+	return len > 16 ? (len - 1) & ~(size_t)15 : 0;
+}
+
+/*
+ * Hash what's left after the first off bytes.  Short keys are read
+ * with overlapping loads rather than byte by byte.
+ */
+static inline uint64_t
+hash_finish(uint64_t h, const unsigned char *p, size_t off, size_t len)
+{
+	uint64_t a, b;
+	size_t m;
+
+	if (len > 16) {
+		for (; off < hash_blocks(len); off += 16)
+			h = hash_block(h, p + off);
+		a = load64(p + len - 16);
+		b = load64(p + len - 8);
+	} else if (len >= 4) {
+		m = (len >> 3) << 2;
+		a = load32(p) << 32 | load32(p + m);
+		b = load32(p + len - 4) << 32 | load32(p + len - 4 - m);
+	} else if (len > 0) {
+		a = (uint64_t)p[0] << 16 | (uint64_t)p[len >> 1] << 8 |
+		    p[len - 1];
+		b = 0;
+	} else
+		a = b = 0;
+	return mum(a ^ K2, b ^ h ^ K3);
+}
+
+static inline uint64_t
+fmix64(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static inline void
+hash_point(uint64_t h, uint64_t *p)
+{
+	int k;
+
+	for (k = 0; k < CAN_DIMS; ++k)
+		p[k] = fmix64(h + (k + 1) * GAMMA);
+}
+
+uint64_t
+key_hash(const void *key, size_t len)
+{
+	return fmix64(hash_finish(hash_start(len), key, 0, len));
+}
+
+void
+key_point(const void *key, size_t len, uint64_t *p)
+{
+	hash_point(hash_finish(hash_start(len), key, 0, len), p);
+}
+
+/*
+ * Move the point of a key to reality r, where it lands somewhere
+ * unrelated to where it is in the others.  Reality 0 keeps the point
+ * of key_point.
+ */
+void
+key_reality(uint64_t *p, int r)
+{
+	int k;
+
+	if (r == 0)
+		return;
+	for (k = 0; k < CAN_DIMS; ++k)
+		p[k] = fmix64(p[k] + r * GAMMA);
+}
+
+/*
+ * Map n keys to n points, stored one after the other in p.  Keys
+ * are taken KEY_LANES at a time and their common blocks hashed in
+ * lockstep: the multiplications of different keys don't depend on
+ * each other, so they overlap in the pipeline instead of waiting one
+ * for the other.  The lanes are spelled out to keep them in registers.
+ */
+void
+key_points(const struct key *keys, size_t n, uint64_t *p)
+{
+	const unsigned char *s0, *s1, *s2, *s3;
+	const struct key *k;
+	uint64_t h0, h1, h2, h3;
+	size_t i, off, common;
+
+	for (i = 0; i + KEY_LANES <= n; i += KEY_LANES) {
+		k = &keys[i];
+		s0 = (const unsigned char *)k[0].data;
+		s1 = (const unsigned char *)k[1].data;
+		s2 = (const unsigned char *)k[2].data;
+		s3 = (const unsigned char *)k[3].data;
+		h0 = hash_start(k[0].len);
+		h1 = hash_start(k[1].len);
+		h2 = hash_start(k[2].len);
+		h3 = hash_start(k[3].len);
+
+		common = hash_blocks(k[0].len);
+		if (hash_blocks(k[1].len) < common)
+			common = hash_blocks(k[1].len);
+		if (hash_blocks(k[2].len) < common)
+			common = hash_blocks(k[2].len);
+		if (hash_blocks(k[3].len) < common)
+			common = hash_blocks(k[3].len);
+
+		for (off = 0; off < common; off += 16) {
+			h0 = hash_block(h0, s0 + off);
+			h1 = hash_block(h1, s1 + off);
+			h2 = hash_block(h2, s2 + off);
+			h3 = hash_block(h3, s3 + off);
+		}
+
+		hash_point(hash_finish(h0, s0, common, k[0].len), p);
+		hash_point(hash_finish(h1, s1, common, k[1].len),
+		    p + CAN_DIMS);
+		hash_point(hash_finish(h2, s2, common, k[2].len),
+		    p + 2 * CAN_DIMS);
+		hash_point(hash_finish(h3, s3, common, k[3].len),
+		    p + 3 * CAN_DIMS);
+		p += KEY_LANES * CAN_DIMS;
+	}
+
+	for (; i < n; ++i, p += CAN_DIMS)
+		key_point(keys[i].data, keys[i].len, p);
+}
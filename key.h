@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_KEY_H
+#define HIRO_KEY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Keys are arbitrary bytes that map to a point of the CAN space.
+ * The hash isn't cryptographic, but it's the same on every node
+ * regardless of its endianness.
+ */
+struct key {
+	const char	*data;
+	size_t		 len;
+};
+
+/* keys key_points hashes in lockstep, one per lane */
+#define KEY_LANES	4
+
+uint64_t	 key_hash(const void*, size_t);
+void		 key_point(const void*, size_t, uint64_t*);
+void		 key_points(const struct key*, size_t, uint64_t*);
+void		 key_reality(uint64_t*, int);
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * hiro-keybench: hash a set of random keys to points of the CAN
+ * space one at a time and in batches, measure how long it takes
+ * and how evenly the points are spread along every axis.
+ */
+
+#include "can.h"
+#include "key.h"
+
+#include "arc4random.h"
+#include "err.h"
+#include "strtonum.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* points are counted in this many slices of every axis */
+#define NSLICES		256
+
+/*
+ * Keys are timed this many bytes at a time, all the rounds over a
+ * chunk before the next one, so that they come from the cache: it's
+ * the hashing that's measured, not the memory.
+ */
+#define CHUNK_BYTES	(256 * 1024)
+
+int		 nkeys = 1000000;
+int		 keysize = 16;
+int		 rounds = 10;
+
+static void
+usage(const char *me)
+{
+	fprintf(stderr, "USAGE: %s [-n keys] [-r rounds] [-s size]\n", me);
+	exit(1);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct key *keys;
+	uint64_t *p, *q, start, single, batch, slices[NSLICES];
+	uint64_t lo, hi;
+	const char *errstr;
+	char *data;
+	size_t i, j, m, chunk;
+	int ch, k, r;
+
+	while ((ch = getopt(argc, argv, "n:r:s:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nkeys = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "keys are %s: %s", errstr, optarg);
+			break;
+		case 'r':
+			rounds = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "rounds are %s: %s", errstr, optarg);
+			break;
+		case 's':
+			keysize = strtonum(optarg, 0, 1024 * 1024, &errstr);
+			if (errstr != NULL)
+				errx(1, "key size is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage(*argv);
+		}
+	}
+	if (argc != optind)
+		usage(*argv);
+
+	if ((keys = calloc(nkeys, sizeof(*keys))) == NULL ||
+	    (data = malloc((size_t)nkeys * keysize + 1)) == NULL ||
+	    (p = calloc(nkeys, CAN_DIMS * sizeof(*p))) == NULL ||
+	    (q = calloc(nkeys, CAN_DIMS * sizeof(*q))) == NULL)
+		err(1, "calloc");
+
+	arc4random_buf(data, (size_t)nkeys * keysize);
+	for (i = 0; i < (size_t)nkeys; ++i) {
+		keys[i].data = data + i * keysize;
+		keys[i].len = keysize;
+	}
+
+	chunk = CHUNK_BYTES / (keysize + 1) + 1;
+	single = batch = 0;
+	for (i = 0; i < (size_t)nkeys; i += m) {
+		m = nkeys - i < chunk ? nkeys - i : chunk;
+		key_points(keys + i, m, q + i * CAN_DIMS);
+
+		start = now_ns();
+		for (r = 0; r < rounds; ++r)
+			for (j = i; j < i + m; ++j)
+				key_point(keys[j].data, keys[j].len,
+				    p + j * CAN_DIMS);
+		single += now_ns() - start;
+
+		start = now_ns();
+		for (r = 0; r < rounds; ++r)
+			key_points(keys + i, m, q + i * CAN_DIMS);
+		batch += now_ns() - start;
+	}
+
+	if (memcmp(p, q, (size_t)nkeys * CAN_DIMS * sizeof(*p)) != 0)
+		errx(1, "key_points and key_point disagree");
+
+	printf("dimensions:   %d\n", CAN_DIMS);
+	printf("keys:         %d of %d bytes, %d rounds\n", nkeys, keysize,
+	    rounds);
+	printf("single:       %.1f ns/key (%.2f GB/s)\n",
+	    (double)single / nkeys / rounds,
+	    (double)nkeys * keysize * rounds / single);
+	printf("batched:      %.1f ns/key (%.2f GB/s)\n",
+	    (double)batch / nkeys / rounds,
+	    (double)nkeys * keysize * rounds / batch);
+
+	for (k = 0; k < CAN_DIMS; ++k) {
+		memset(slices, 0, sizeof(slices));
+		for (i = 0; i < (size_t)nkeys; ++i)
+			slices[p[i * CAN_DIMS + k] >> 56]++;
+
+		lo = UINT64_MAX;
+		hi = 0;
+		for (i = 0; i < NSLICES; ++i) {
+			if (slices[i] < lo)
+				lo = slices[i];
+			if (slices[i] > hi)
+				hi = slices[i];
+		}
+		printf("axis %d:       %" PRIu64 " to %" PRIu64
+		    " keys per slice, %.1f expected\n", k, lo, hi,
+		    (double)nkeys / NSLICES);
+	}
+
+	return 0;
+}
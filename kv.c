@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "key.h"
+#include "kv.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define KV_MINSLOTS	1024
+
+int
+kv_init(struct kv *kv)
+{
+	memset(kv, 0, sizeof(*kv));
+	kv->nslots = KV_MINSLOTS;
+	kv->slots = calloc(kv->nslots, sizeof(*kv->slots));
+	return kv->slots == NULL ? -1 : 0;
+}
+
+static void
+free_chunks(struct kvchunk *c)
+{
+	struct kvchunk *next;
+
+	for (; c != NULL; c = next) {
+		next = c->next;
+		free(c);
+	}
+}
+
+void
+kv_free(struct kv *kv)
+{
+	free(kv->slots);
+	free_chunks(kv->chunks);
+	memset(kv, 0, sizeof(*kv));
+}
+
+static inline uint64_t
+hash(const char *k, size_t klen)
+{
+	uint64_t h;
+
+	h = key_hash(k, klen);
+	return h == 0 ? 1 : h;
+}
+
+/* the slot of the key, or the empty one where it would go */
+static inline size_t
+find(struct kv *kv, uint64_t h, const char *k, size_t klen)
+{
+	struct kvent *e;
+	size_t i, mask = kv->nslots - 1;
+
+	for (i = h & mask;; i = (i + 1) & mask) {
+		e = &kv->slots[i];
+		if (e->hash == 0 || (e->hash == h && e->klen == klen &&
+		    !memcmp(e->data, k, klen)))
+			return i;
+	}
+}
+
+static char *
+arena_alloc(struct kv *kv, size_t len)
+{
+	struct kvchunk *c = kv->chunks;
+	size_t size;
+	char *p;
+
+	if (c == NULL || c->size - c->off < len) {
+		size = len > KV_CHUNK ? len : KV_CHUNK;
+		if ((c = malloc(sizeof(*c) + size)) == NULL)
+			return NULL;
+		c->size = size;
+		c->off = 0;
+		c->next = kv->chunks;
+		kv->chunks = c;
+		kv->arena += size;
+	}
+
+	p = c->data + c->off;
+	c->off += len;
+	return p;
+}
+
+/*
+ * Move the live entries to a fresh arena once the garbage is more
+ * than the live data.  The slots don't move.
+ */
+static void
+compact(struct kv *kv)
+{
+	struct kvchunk *old;
+	struct kvent *e;
+	size_t i, len, arena;
+	char *p;
+
+	if (kv->arena <= KV_CHUNK || kv->arena - kv->live <= kv->live)
+		return;
+
+	old = kv->chunks;
+	arena = kv->arena;
+	kv->chunks = NULL;
+	kv->arena = 0;
+
+	for (i = 0; i < kv->nslots; ++i) {
+		e = &kv->slots[i];
+		if (e->hash == 0)
+			continue;
+		len = e->klen + e->vlen + 2;
+		if ((p = arena_alloc(kv, len)) == NULL) {
+			/* keep the old arena too, try again later */
+			free_chunks(kv->chunks);
+			kv->chunks = old;
+			kv->arena = arena;
+			return;
+		}
+		memcpy(p, e->data, len);
+		e->data = p;
+	}
+
+	free_chunks(old);
+}
+
+/* double the slots; restarts kv_sweep */
+static int
+grow(struct kv *kv)
+{
+	struct kvent *slots, *old = kv->slots;
+	size_t i, j, mask, n = kv->nslots;
+
+	if ((slots = calloc(n * 2, sizeof(*slots))) == NULL)
+		return -1;
+
+	mask = n * 2 - 1;
+	for (i = 0; i < n; ++i) {
+		if (old[i].hash == 0)
+			continue;
+		for (j = old[i].hash & mask; slots[j].hash != 0;
+		    j = (j + 1) & mask)
+			;
+		slots[j] = old[i];
+	}
+
+	free(old);
+	kv->slots = slots;
+	kv->nslots = n * 2;
+	kv->cursor = 0;
+	return 0;
+}
+
+/*
+ * Backward-shift deletion: the entries after the hole that may live
+ * there are moved back, so no tombstones are needed.  Entries only
+ * move towards the hole, never past i.
+ */
+static void
+remove_at(struct kv *kv, size_t i)
+{
+	struct kvent *e = &kv->slots[i];
+	size_t j, home, mask = kv->nslots - 1;
+
+	kv->count--;
+	kv->live -= e->klen + e->vlen + 2;
+
+	for (j = (i + 1) & mask; kv->slots[j].hash != 0; j = (j + 1) & mask) {
+		home = kv->slots[j].hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			kv->slots[i] = kv->slots[j];
+			i = j;
+		}
+	}
+	kv->slots[i].hash = 0;
+}
+
+int
+kv_put(struct kv *kv, const char *k, size_t klen, const char *v,
+    size_t vlen)
+{
+	struct kvent *e;
+	uint64_t h;
+	char *p;
+
+	/* keep the load factor under 3/4 */
+	if ((kv->count + 1) * 4 > kv->nslots * 3 && grow(kv) == -1)
+		return -1;
+
+	h = hash(k, klen);
+	e = &kv->slots[find(kv, h, k, klen)];
+
+	/* a value that isn't longer is overwritten in place */
+	if (e->hash != 0 && vlen <= e->vlen) {
+		memcpy(e->data + klen + 1, v, vlen);
+		e->data[klen + 1 + vlen] = '\0';
+		kv->live -= e->vlen - vlen;
+		e->vlen = vlen;
+		return 0;
+	}
+
+	if ((p = arena_alloc(kv, klen + vlen + 2)) == NULL)
+		return -1;
+	memcpy(p, k, klen);
+	p[klen] = '\0';
+	memcpy(p + klen + 1, v, vlen);
+	p[klen + 1 + vlen] = '\0';
+
+	if (e->hash != 0)
+		kv->live -= e->klen + e->vlen + 2;
+	else
+		kv->count++;
+	kv->live += klen + vlen + 2;
+
+	e->hash = h;
+	e->data = p;
+	e->klen = klen;
+	e->vlen = vlen;
+
+	compact(kv);
+	return 0;
+}
+
+/* the NUL-terminated value of the key, or NULL */
+const char *
+kv_get(struct kv *kv, const char *k, size_t klen, size_t *vlen)
+{
+	struct kvent *e;
+
+	e = &kv->slots[find(kv, hash(k, klen), k, klen)];
+	if (e->hash == 0)
+		return NULL;
+	if (vlen != NULL)
+		*vlen = e->vlen;
+	return e->data + e->klen + 1;
+}
+
+/* returns -1 if there's no such key */
+int
+kv_del(struct kv *kv, const char *k, size_t klen)
+{
+	size_t i;
+
+	i = find(kv, hash(k, klen), k, klen);
+	if (kv->slots[i].hash == 0)
+		return -1;
+	remove_at(kv, i);
+	compact(kv);
+	return 0;
+}
+
+/*
+ * Pass every entry to fn, dropping the ones it returns 1 for.  If
+ * fn returns -1 the walk stops there and kv_sweep returns -1: the
+ * next call resumes it.  fn may see the entries it keeps more than
+ * once, but every entry at least once.
+ */
+int
+kv_sweep(struct kv *kv, kv_sweepfn fn, void *arg)
+{
+	struct kvent *e;
+	int r;
+
+	while (kv->cursor < kv->nslots) {
+		e = &kv->slots[kv->cursor];
+		if (e->hash == 0) {
+			kv->cursor++;
+			continue;
+		}
+
+		r = fn(e->data, e->klen, e->data + e->klen + 1, e->vlen, arg);
+		if (r == -1)
+			return -1;
+		if (r == 1)
+			remove_at(kv, kv->cursor);	/* look at it again */
+		else
+			kv->cursor++;
+	}
+
+	kv->cursor = 0;
+	compact(kv);
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_KV_H
+#define HIRO_KV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* limits on what PUT accepts */
+#define KV_MAXKEY	256
+#define KV_MAXVALUE	3072
+
+/* the arena grows by this much at a time */
+#define KV_CHUNK	(1024 * 1024)
+
+/*
+ * An entry of the table.  The key and the value are stored one after
+ * the other in the arena, both NUL-terminated; hash 0 marks an empty
+ * slot.
+ */
+struct kvent {
+	uint64_t	 hash;
+	char		*data;
+	uint32_t	 klen;
+	uint32_t	 vlen;
+};
+
+struct kvchunk {
+	struct kvchunk	*next;
+	size_t		 size;
+	size_t		 off;
+	char		 data[];
+};
+
+/*
+ * Open-addressing hash table with linear probing.  Overwritten and
+ * deleted entries leave garbage in the arena that is compacted away
+ * once it outgrows the live data.
+ */
+struct kv {
+	struct kvent	*slots;
+	size_t		 nslots;	/* a power of two */
+	size_t		 count;
+	size_t		 live;		/* bytes of keys and values */
+	size_t		 arena;		/* bytes of chunks */
+	size_t		 cursor;	/* of kv_sweep, 0 restarts it */
+	struct kvchunk	*chunks;	/* newest first */
+};
+
+/* returns 0 to keep the entry, 1 to drop it or -1 to stop */
+typedef int (*kv_sweepfn)(const char*, size_t, const char*, size_t, void*);
+
+int		 kv_init(struct kv*);
+void		 kv_free(struct kv*);
+int		 kv_put(struct kv*, const char*, size_t, const char*, size_t);
+const char	*kv_get(struct kv*, const char*, size_t, size_t*);
+int		 kv_del(struct kv*, const char*, size_t);
+int		 kv_sweep(struct kv*, kv_sweepfn, void*);
+
+#endif
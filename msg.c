@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "msg.h"
+
+#include <stdlib.h>
+
+/*
+ * Blocks are rounded up to a power of two between 64 bytes and
+ * 128KB; each class keeps a free list of at most MSG_KEEP blocks.
+ * Bigger messages go straight to malloc.  Every thread has its own
+ * pool: a message freed by another worker ends up in its pool.
+ */
+#define MSG_MINSHIFT	6
+#define MSG_NCLASSES	12
+#define MSG_NOCLASS	MSG_NCLASSES
+#define MSG_KEEP	256
+
+struct freeblk {
+	struct freeblk	*next;
+};
+
+static __thread struct {
+	struct freeblk	*head;
+	size_t		 len;
+} pool[MSG_NCLASSES];
+
+static inline unsigned int
+size_class(size_t size)
+{
+	unsigned int c;
+
+	if (size <= (1UL << MSG_MINSHIFT))
+		return 0;
+
+	c = sizeof(unsigned long) * 8 - __builtin_clzl(size - 1);
+	c -= MSG_MINSHIFT;
+	return c < MSG_NCLASSES ? c : MSG_NOCLASS;
+}
+
+/*
+ * Return a message able to hold len bytes of payload, with a
+ * reference count of one.  The caller fills data.
+ */
+struct msg *
+msg_alloc(size_t len)
+{
+	struct msg *m;
+	struct freeblk *f;
+	size_t size;
+	unsigned int c;
+
+	if (len > UINT32_MAX)
+		return NULL;
+
+	size = sizeof(*m) + len;
+	c = size_class(size);
+
+	if (c != MSG_NOCLASS && (f = pool[c].head) != NULL) {
+		pool[c].head = f->next;
+		pool[c].len--;
+		m = (struct msg *)f;
+	} else {
+		if (c != MSG_NOCLASS)
+			size = 1UL << (c + MSG_MINSHIFT);
+		if ((m = malloc(size)) == NULL)
+			return NULL;
+	}
+
+	m->rc = 1;
+	m->len = len;
+	m->class = c;
+	return m;
+}
+
+/* messages are shared between workers, hence the atomics */
+struct msg *
+msg_ref(struct msg *m)
+{
+	__atomic_add_fetch(&m->rc, 1, __ATOMIC_RELAXED);
+	return m;
+}
+
+void
+msg_unref(struct msg *m)
+{
+	struct freeblk *f;
+	unsigned int c;
+
+	if (__atomic_sub_fetch(&m->rc, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	c = m->class;
+	if (c == MSG_NOCLASS || pool[c].len == MSG_KEEP) {
+		free(m);
+		return;
+	}
+
+	f = (struct freeblk *)m;
+	f->next = pool[c].head;
+	pool[c].head = f;
+	pool[c].len++;
+}
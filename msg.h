@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_MSG_H
+#define HIRO_MSG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A refcounted message: the header and the payload live in the same
+ * block, taken from a size-classed pool.
+ */
+struct msg {
+	uint32_t	rc;
+	uint32_t	len;
+	uint32_t	class;
+	char		data[];
+};
+
+struct msg	*msg_alloc(size_t);
+struct msg	*msg_ref(struct msg*);
+void		 msg_unref(struct msg*);
+
+#endif
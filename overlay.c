@@ -0,0 +1,2217 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "can.h"
+#include "cmd.h"
+#include "dedup.h"
+#include "group.h"
+#include "hiro.h"
+#include "key.h"
+#include "kv.h"
+#include "log.h"
+#include "overlay.h"
+#include "peer.h"
+#include "pool.h"
+#include "resolv.h"
+#include "route.h"
+#include "stats.h"
+#include "wire.h"
+
+#include "arc4random.h"
+#include "err.h"
+#include "queue.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Overlay frames are sent as wire frames.  The reality r, the hop
+ * count, the point and the id are in the binary header; the body
+ * has the rest as strings.  Zones are sent as hex strings, one per
+ * coordinate; nodes as id, host, port.
+ *
+ *	FORWARD	r hops point	to payload	routed
+ *	JOIN	r hops point	id host port	routed
+ *	PUT	r hops point reqid	id host port key value	routed
+ *	GET	r hops point reqid	id host port key	routed
+ *	DEL	r hops point reqid	id host port key	routed
+ *	WELCOME	r	zone... (id host port zone...)*
+ *	UPDATE	r	id host port (zone...)*
+ *	RESULT	reqid	status [value]
+ *	BROADCAST	id point	axis side to payload	flooded
+ *	SUBSCRIBE		id host port topic
+ *	UNSUBSCRIBE		id host port topic
+ *	PUBLISH	hops point id	origin to payload	routed
+ *	DELIVER	id	origin to payload
+ *	HELLO	r hops point	id host port (zone...)*	routed
+ *	PROBE		id host port stamp
+ *	ECHO		id stamp
+ *	LEAVE	r	id host port id host port n zone...
+ *			    (id host port zone...)*
+ *
+ * Routed frames travel greedily towards the owner of the point, the
+ * others are sent straight to the node they're for.  A hop only
+ * bumps the count in the header and passes the body along as it is.
+ * The owner of the point of a key stores it and answers PUT, GET and
+ * DEL with a RESULT to the node that asked, unless reqid is 0.
+ * Neighbors are PROBEd every now and then and the ECHOes give their
+ * RTT, that weighs the choice of the next hop.  A neighbor that
+ * doesn't answer for a while is gone: each of its zones is taken
+ * over by the owner of the point just below its corner, and the
+ * other neighbors send a HELLO to that point to meet the new owner,
+ * that answers with an UPDATE.
+ *
+ * A node that shuts down hands its zones over instead.  In every
+ * reality it sends a LEAVE to its neighbors with itself, its
+ * successor, its n zones and its neighbor table.  The successor takes
+ * the zones over and announces them with an UPDATE; the others give
+ * them to the successor meanwhile.  The keys follow on the same link
+ * to the successor as PUTs, and the node exits once they're written.
+ *
+ * A BROADCAST reaches every node of the first reality: each passes
+ * it on only along the axes below the one it came in, and along that
+ * one in the same direction, so most nodes get it once.  The ids of
+ * the broadcasts seen recently catch the copies that still arrive.
+ *
+ * A topic has a rendezvous too, the owner of its point in the first
+ * reality.  Nodes with subscribers to it SUBSCRIBE to their next hop
+ * towards the rendezvous, which records them as its children and
+ * subscribes in turn, unless it's already part of the tree.  A SEND
+ * is routed to the rendezvous as a PUBLISH and goes down the tree
+ * from there as DELIVERs, so it reaches only the nodes interested in
+ * it.  The tree is soft state: nodes subscribe again every now and
+ * then, following the changes of the overlay, and the children that
+ * stop doing so expire.
+ *
+ * Every node takes part in the same number of independent overlays,
+ * the realities, and holds a zone in each; r says which one a frame
+ * is about.  A key is stored once per reality, at a different point
+ * in each.  GETs go along the reality where we're the closest to the
+ * key and fall back on the others if it fails, or, when racing, go
+ * along all of them at once and the first answer wins.
+ */
+
+/* probe every neighbor this often; it's gone if it doesn't answer */
+#define PROBE_MS	1000
+#define DEAD_MS		(5 * PROBE_MS)
+
+/* look for the new owner of a zone of a dead neighbor after this */
+#define REPAIR_MS	(2 * PROBE_MS)
+
+/* give up waiting for a reality to answer a request after this */
+#define PENDING_MS	2000
+
+/*
+ * The reqid sent to a reality for a pending request carries the
+ * reality in its low bits, enough for OVERLAY_MAXREALITIES, so that
+ * its answer can't be mistaken for the one of another attempt.
+ */
+#define PENDING_RBITS	3
+#define PENDING_ID(id, r)	((id) << PENDING_RBITS | (r))
+
+/* retry moving keys to their new owner after this long */
+#define REHOME_USEC	10000
+
+/* moving keys leaves this much of a link free for the other frames */
+#define REHOME_SLACK	(16 * 1024)
+
+/* give up handing our zones and keys over after this */
+#define LEAVE_MS	(5 * 1000)
+
+/* subscribe to the parent again this often; children expire after */
+#define GROUP_REFRESH_SEC	5
+#define GROUP_EXPIRE_SEC	(3 * GROUP_REFRESH_SEC)
+
+/* one of the overlays, and the keys in our zones of it */
+struct reality {
+	int		 id;
+	struct can	 can;
+	struct kv	 store;
+	struct node	*heir;		/* gets our keys, we're leaving */
+};
+
+/*
+ * A node we know about.  The ones in the neighbor tables are probed,
+ * each on its own timer.
+ */
+struct neighbor {
+	struct node	 node;
+	struct timer	 probe;
+	uint64_t	 seen;		/* ns, when it last answered */
+	uint64_t	 gen;		/* of the tables it was last in */
+};
+
+#define NEIGHBOR(n)	((struct neighbor *)(n))
+
+/* a zone of a dead neighbor, to look for its new owner */
+struct repair {
+	struct timer	 timer;
+	int		 reality;
+	uint64_t	 point[CAN_DIMS];
+};
+
+/*
+ * A request that goes to more than one reality, answered when
+ * enough of them did.
+ */
+struct pending {
+	uint64_t		 id;
+	uint64_t		 reqid;		/* for kv_answer */
+	enum cmd_type		 type;
+	unsigned int		 tried;		/* realities, one bit each */
+	unsigned int		 waiting;	/* for their answer, ditto */
+	int			 ok;		/* answers that were CMD_OK */
+	int			 done;		/* kv_answer was called */
+	char			 key[KV_MAXKEY + 1];
+	struct timer		 timer;		/* for the current answers */
+	LIST_ENTRY(pending)	 entry;
+};
+
+static struct node	 self;
+static struct node	 boot;		/* where we join from */
+static struct reality	 realities[OVERLAY_MAXREALITIES];
+static int		 nrealities;
+static int		 racing;	/* GETs go to every reality */
+static struct pool	 nodepool;
+static LIST_HEAD(, node) nodes;
+static struct pool	 pendingpool;
+static LIST_HEAD(, pending) pendings;
+static uint64_t		 pendingseq;
+static struct event	 rehome_ev;
+static uint64_t		 neighgen;	/* bumped at every change */
+static struct dedup	 msgseen;	/* broadcast and publish ids */
+static struct groups	 groups;
+static struct timer	 refresh;
+static int		 alone = 1;	/* read by every worker */
+static void		(*leavedone)(void);	/* we're leaving */
+static struct timer	 leavetimer;
+
+/* an outgoing frame: the fields of the header and the body */
+struct frame {
+	int		 reality;
+	uint64_t	 id;
+	uint64_t	 point[CAN_DIMS];
+	size_t		 len;
+	char		 data[WIRE_MAXLEN];
+};
+
+/* walks the arguments of a frame */
+struct args {
+	char		*p;
+	char		*end;
+};
+
+static void	 handle_probe(void*);
+static void	 probe_neighbors(void);
+static void	 routed(struct wire*);
+
+static void
+frame_start(struct frame *f, int reality, uint64_t id)
+{
+	f->reality = reality;
+	f->id = id;
+	memset(f->point, 0, sizeof(f->point));
+	f->len = 0;
+}
+
+static void
+frame_add(struct frame *f, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	/* an overflowing frame is caught by frame_send */
+	if (f->len >= sizeof(f->data)) {
+		f->len = sizeof(f->data) + 1;
+		return;
+	}
+
+	va_start(ap, fmt);
+	r = vsnprintf(f->data + f->len, sizeof(f->data) - f->len, fmt, ap);
+	va_end(ap);
+
+	f->len += r + 1;
+}
+
+static void
+frame_add_node(struct frame *f, const struct node *n)
+{
+	frame_add(f, "%016llx", (unsigned long long)n->id);
+	frame_add(f, "%s", n->hostname);
+	frame_add(f, "%s", n->portno);
+}
+
+static void
+frame_add_zone(struct frame *f, const struct zone *z)
+{
+	int k;
+
+	for (k = 0; k < CAN_DIMS; ++k)
+		frame_add(f, "%016llx", (unsigned long long)z->lo[k]);
+	for (k = 0; k < CAN_DIMS; ++k)
+		frame_add(f, "%016llx", (unsigned long long)z->len[k]);
+}
+
+/* the wire frame for f, that stays valid as long as f does */
+static void
+frame_wire(struct frame *f, enum cmd_type type, struct wire *w)
+{
+	w->type = type;
+	w->reality = f->reality;
+	w->hops = 0;
+	w->id = f->id;
+	memcpy(w->point, f->point, sizeof(w->point));
+	w->data = f->data;
+	w->len = f->len;
+}
+
+/* queue w on the link to n */
+static int
+wire_send(struct node *n, const struct wire *w)
+{
+	if (peer_send(n, w) == -1) {
+		log_warn("failed to queue %s for %s:%s", cmd_name(w->type),
+		    n->hostname, n->portno);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+frame_send(struct node *n, enum cmd_type type, struct frame *f)
+{
+	struct wire w;
+
+	if (f->len > sizeof(f->data)) {
+		log_warn("%s frame for %s:%s too long", cmd_name(type),
+		    n->hostname, n->portno);
+		return -1;
+	}
+
+	frame_wire(f, type, &w);
+	return wire_send(n, &w);
+}
+
+static char *
+next_arg(struct args *a)
+{
+	char *s;
+
+	if (a->p == a->end)
+		return NULL;
+	s = a->p;
+	a->p += strlen(s) + 1;
+	return s;
+}
+
+static int
+next_u64(struct args *a, uint64_t *v)
+{
+	char *s, *ep;
+
+	if ((s = next_arg(a)) == NULL || *s == '\0')
+		return -1;
+	*v = strtoull(s, &ep, 16);
+	return *ep == '\0' ? 0 : -1;
+}
+
+static int
+next_point(struct args *a, uint64_t *p)
+{
+	int k;
+
+	for (k = 0; k < CAN_DIMS; ++k)
+		if (next_u64(a, &p[k]) == -1)
+			return -1;
+	return 0;
+}
+
+static int
+next_zone(struct args *a, struct zone *z)
+{
+	if (next_point(a, z->lo) == -1 || next_point(a, z->len) == -1)
+		return -1;
+	return 0;
+}
+
+/* the node with the given id, which is created or updated */
+static struct node *
+node_get(uint64_t id, const char *host, const char *port)
+{
+	struct node *n;
+	char *h, *p;
+
+	if (id == self.id)
+		return &self;
+
+	LIST_FOREACH(n, &nodes, node) {
+		if (n->id != id)
+			continue;
+		if (!strcmp(n->hostname, host) && !strcmp(n->portno, port))
+			return n;
+		break;
+	}
+
+	if ((h = strdup(host)) == NULL || (p = strdup(port)) == NULL) {
+		free(h);
+		return NULL;
+	}
+
+	if (n == NULL) {
+		if ((n = pool_get(&nodepool)) == NULL) {
+			free(h);
+			free(p);
+			return NULL;
+		}
+		n->id = id;
+		n->peer = NULL;
+		n->rtt = 0;
+		timer_set(&NEIGHBOR(n)->probe, handle_probe, n);
+		NEIGHBOR(n)->gen = 0;
+		LIST_INSERT_HEAD(&nodes, n, node);
+	} else {
+		free((char *)n->hostname);
+		free((char *)n->portno);
+	}
+
+	n->hostname = h;
+	n->portno = p;
+	return n;
+}
+
+/* the reality w is about, or NULL if we don't take part in it */
+static struct reality *
+wire_reality(const struct wire *w)
+{
+	if (w->reality >= nrealities)
+		return NULL;
+	return &realities[w->reality];
+}
+
+static void
+args_init(struct args *a, const struct wire *w)
+{
+	a->p = w->data;
+	a->end = w->data + w->len;
+}
+
+static struct node *
+next_node(struct args *a)
+{
+	uint64_t id;
+	char *host, *port;
+
+	if (next_u64(a, &id) == -1 ||
+	    (host = next_arg(a)) == NULL ||
+	    (port = next_arg(a)) == NULL)
+		return NULL;
+	return node_get(id, host, port);
+}
+
+static void
+overlay_stats(void)
+{
+	struct reality *rl;
+	int r;
+
+	stats.zones = 0;
+	stats.neighbors = 0;
+	stats.kv_keys = 0;
+	stats.kv_bytes = 0;
+	stats.kv_arena = 0;
+	for (r = 0; r < nrealities; ++r) {
+		rl = &realities[r];
+		stats.zones += rl->can.nzones;
+		stats.neighbors += rl->can.nneigh;
+		stats.kv_keys += rl->store.count;
+		stats.kv_bytes += rl->store.live;
+		stats.kv_arena += rl->store.arena;
+	}
+	stats.groups = groups.count;
+	probe_neighbors();
+
+	/* nobody to send the publishes to */
+	__atomic_store_n(&alone, realities[0].can.nneigh == 0,
+	    __ATOMIC_RELAXED);
+}
+
+/* whether n is one of the first i neighbors in c */
+static int
+seen(const struct can *c, size_t i, const struct node *n)
+{
+	size_t j;
+
+	for (j = 0; j < i; ++j)
+		if (c->nnode[j] == n)
+			return 1;
+	return 0;
+}
+
+/* whether n is a neighbor in one of the first r realities */
+static int
+seen_before(int r, const struct node *n)
+{
+	int s;
+
+	for (s = 0; s < r; ++s)
+		if (seen(&realities[s].can, realities[s].can.nneigh, n))
+			return 1;
+	return 0;
+}
+
+/*
+ * Send the frame to every neighbor in reality rl, once per node.  If
+ * rl is NULL, to the neighbors in every reality.
+ */
+static void
+send_neighbors(struct reality *rl, enum cmd_type type, struct frame *f)
+{
+	struct can *c;
+	struct node *n;
+	size_t i;
+	int r;
+
+	for (r = 0; r < nrealities; ++r) {
+		if (rl != NULL && rl != &realities[r])
+			continue;
+		c = &realities[r].can;
+		for (i = 0; i < c->nneigh; ++i) {
+			n = c->nnode[i];
+			if (seen(c, i, n) || (rl == NULL && seen_before(r, n)))
+				continue;
+			frame_send(n, type, f);
+		}
+	}
+}
+
+/* tell every neighbor in rl about the zones we own now */
+static void
+announce(struct reality *rl)
+{
+	static struct frame f;
+	size_t i;
+
+	frame_start(&f, rl->id, 0);
+	frame_add_node(&f, &self);
+	for (i = 0; i < rl->can.nzones; ++i)
+		frame_add_zone(&f, &rl->can.zones[i]);
+	send_neighbors(rl, CMD_UPDATE, &f);
+}
+
+/* the middle of z */
+static void
+zone_center(const struct zone *z, uint64_t *p)
+{
+	int k;
+
+	for (k = 0; k < CAN_DIMS; ++k) {
+		p[k] = z->lo[k];
+		if (z->len[k] == 0)
+			p[k] += (uint64_t)1 << 63;
+		else
+			p[k] += z->len[k] / 2;
+	}
+}
+
+/* ask the owner of the point of rp about its zones, and tell ours */
+static void
+handle_repair(void *d)
+{
+	static struct frame f;
+	struct repair *rp = d;
+	struct reality *rl = &realities[rp->reality];
+	struct wire w;
+	size_t i;
+
+	frame_start(&f, rl->id, 0);
+	memcpy(f.point, rp->point, sizeof(f.point));
+	free(rp);
+	frame_add_node(&f, &self);
+	for (i = 0; i < rl->can.nzones; ++i)
+		frame_add_zone(&f, &rl->can.zones[i]);
+
+	frame_wire(&f, CMD_HELLO, &w);
+	routed(&w);
+}
+
+/*
+ * Meet the heir of a zone of a dead neighbor once it took it over.
+ * The HELLO goes to the heir point rather than into the zone: that
+ * one is still owned by someone, greedy routing can't cross the hole
+ * the dead node left.
+ */
+static void
+repair_later(struct reality *rl, const uint64_t *p)
+{
+	struct repair *rp;
+
+	if ((rp = malloc(sizeof(*rp))) == NULL) {
+		log_warn("repair_later: malloc");
+		return;
+	}
+	rp->reality = rl->id;
+	memcpy(rp->point, p, sizeof(rp->point));
+	timer_set(&rp->timer, handle_repair, rp);
+	timer_add(&rp->timer, REPAIR_MS);
+}
+
+/*
+ * The point just below the corner of z, one of the zones zs of a dead
+ * node, along the first axis where that point isn't in zs too: its
+ * owner is the heir of z.  Only the neighbors of the dead node can
+ * be it, and exactly one of them is.
+ */
+static int
+heir_point(const struct zone *zs, size_t nz, const struct zone *z,
+    uint64_t *p)
+{
+	size_t i;
+	int k;
+
+	for (k = 0; k < CAN_DIMS; ++k) {
+		memcpy(p, z->lo, sizeof(z->lo));
+		p[k]--;
+		for (i = 0; i < nz; ++i)
+			if (zone_contains(&zs[i], p))
+				break;
+		if (i == nz)
+			return 0;
+	}
+	return -1;
+}
+
+/* n is gone from rl: take over the zones of it we're the heir of */
+static void
+failed_in(struct reality *rl, struct node *n)
+{
+	struct can *c = &rl->can;
+	struct zone zs[CAN_MAXZONES];
+	uint64_t p[CAN_DIMS];
+	size_t i, nz;
+	int took = 0;
+
+	for (i = 0, nz = 0; i < c->nneigh && nz < CAN_MAXZONES; ++i)
+		if (c->nnode[i] == n)
+			can_neighbor(c, i, &zs[nz++]);
+	if (nz == 0)
+		return;
+	can_remove(c, n);
+
+	for (i = 0; i < nz; ++i) {
+		if (heir_point(zs, nz, &zs[i], p) == -1)
+			continue;
+		if (!can_owns(c, p)) {
+			repair_later(rl, p);
+			continue;
+		}
+		if (can_takeover(c, &zs[i]) == -1) {
+			log_warn("too many zones to take over one more");
+			continue;
+		}
+		stats.takeovers++;
+		took = 1;
+	}
+
+	if (took)
+		announce(rl);
+}
+
+static void
+failed(struct node *n)
+{
+	int r;
+
+	log_info("node %016llx at %s:%s is gone", (unsigned long long)n->id,
+	    n->hostname, n->portno);
+	stats.node_failures++;
+
+	for (r = 0; r < nrealities; ++r)
+		failed_in(&realities[r], n);
+	peer_close(n);
+	overlay_stats();
+}
+
+/* probe a neighbor, unless it didn't answer for too long */
+static void
+handle_probe(void *d)
+{
+	static struct frame f;
+	struct neighbor *nb = d;
+	uint64_t now;
+
+	/* it's not a neighbor anymore, it's probed again if it's back */
+	if (nb->gen != neighgen)
+		return;
+
+	now = stats_now();
+	if (now - nb->seen > DEAD_MS * 1000000ULL) {
+		failed(&nb->node);
+		return;
+	}
+
+	frame_start(&f, 0, 0);
+	frame_add_node(&f, &self);
+	frame_add(&f, "%llx", (unsigned long long)(now / 1000));
+	frame_send(&nb->node, CMD_PROBE, &f);
+
+	timer_add(&nb->probe, PROBE_MS);
+}
+
+/*
+ * Start probing the nodes that just became neighbors, at a random
+ * point of the period so that the probes are spread out.
+ */
+static void
+probe_neighbors(void)
+{
+	struct neighbor *nb;
+	struct can *c;
+	size_t i;
+	int r;
+
+	neighgen++;
+	for (r = 0; r < nrealities; ++r) {
+		c = &realities[r].can;
+		for (i = 0; i < c->nneigh; ++i) {
+			nb = NEIGHBOR(c->nnode[i]);
+			nb->gen = neighgen;
+			if (timer_pending(&nb->probe))
+				continue;
+			nb->seen = stats_now();
+			timer_add(&nb->probe, 1 + arc4random_uniform(PROBE_MS));
+		}
+	}
+}
+
+static void
+probed(struct wire *w)
+{
+	static struct frame f;
+	struct args a;
+	struct node *n;
+	char *stamp;
+
+	args_init(&a, w);
+
+	if ((n = next_node(&a)) == NULL || (stamp = next_arg(&a)) == NULL ||
+	    a.p != a.end) {
+		log_warn("malformed PROBE frame");
+		return;
+	}
+	if (n != &self)
+		NEIGHBOR(n)->seen = stats_now();
+
+	frame_start(&f, 0, 0);
+	frame_add(&f, "%016llx", (unsigned long long)self.id);
+	frame_add(&f, "%s", stamp);
+	frame_send(n, CMD_ECHO, &f);
+}
+
+/* smooth the RTT samples like TCP does, with a gain of 1/8 */
+static void
+echoed(struct wire *w)
+{
+	struct args a;
+	struct node *n;
+	uint64_t id, stamp, now, rtt;
+
+	args_init(&a, w);
+
+	if (next_u64(&a, &id) == -1 || next_u64(&a, &stamp) == -1 ||
+	    a.p != a.end) {
+		log_warn("malformed ECHO frame");
+		return;
+	}
+
+	now = stats_now() / 1000;
+	if (stamp > now)
+		return;
+	rtt = now - stamp;
+	if (rtt == 0)
+		rtt = 1;
+	if (rtt > UINT32_MAX)
+		rtt = UINT32_MAX;
+	hist_add(&stats.rtt, rtt);
+
+	LIST_FOREACH(n, &nodes, node) {
+		if (n->id != id)
+			continue;
+		if (n->rtt == 0)
+			n->rtt = rtt;
+		else
+			n->rtt = (7 * (uint64_t)n->rtt + rtt) / 8;
+		NEIGHBOR(n)->seen = stats_now();
+		break;
+	}
+}
+
+static void	 pending_answer(uint64_t, enum cmd_type, const char*);
+
+/* our own request reqid is over */
+static void
+answer(uint64_t reqid, enum cmd_type status, const char *v)
+{
+	if (nrealities == 1)
+		kv_answer(reqid, status, v);
+	else
+		pending_answer(reqid, status, v);
+}
+
+/* tell n the outcome of its request reqid */
+static void
+result(struct node *n, uint64_t reqid, enum cmd_type status, const char *v)
+{
+	static struct frame f;
+
+	if (reqid == 0)
+		return;
+
+	if (n == &self) {
+		answer(reqid, status, v);
+		return;
+	}
+
+	frame_start(&f, 0, reqid);
+	frame_add(&f, "%x", status);
+	if (v != NULL)
+		frame_add(&f, "%s", v);
+	frame_send(n, CMD_RESULT, &f);
+}
+
+/* run a request for a key we own */
+static void
+serve(struct reality *rl, enum cmd_type type, const char *k, const char *v,
+    uint64_t reqid, struct node *from)
+{
+	const char *val;
+	size_t klen;
+
+	klen = strlen(k);
+	switch (type) {
+	case CMD_PUT:
+		if (kv_put(&rl->store, k, klen, v, strlen(v)) == -1)
+			result(from, reqid, CMD_ERROR, "out of memory");
+		else
+			result(from, reqid, CMD_OK, NULL);
+		break;
+	case CMD_GET:
+		if ((val = kv_get(&rl->store, k, klen, NULL)) == NULL)
+			result(from, reqid, CMD_ERROR, "no such key");
+		else
+			result(from, reqid, CMD_OK, val);
+		break;
+	case CMD_DEL:
+		if (kv_del(&rl->store, k, klen) == -1)
+			result(from, reqid, CMD_ERROR, "no such key");
+		else
+			result(from, reqid, CMD_OK, NULL);
+		break;
+	default:
+		log_warn("serve: unexpected %s", cmd_name(type));
+		return;
+	}
+	overlay_stats();
+}
+
+/*
+ * A key whose point we don't own anymore is PUT to the next hop
+ * towards its new owner, without asking for an answer, or straight
+ * to the heir if we're leaving.  Stops when the link is almost full:
+ * rehome tries again later.
+ */
+static int
+rehome_key(const char *k, size_t klen, const char *v, size_t vlen,
+    void *arg)
+{
+	static struct frame f;
+	struct reality *rl = arg;
+	struct node *n;
+	uint64_t p[CAN_DIMS];
+
+	key_point(k, klen, p);
+	key_reality(p, rl->id);
+	if (rl->heir != NULL)
+		n = rl->heir;
+	else if (can_owns(&rl->can, p) ||
+	    (n = route_next_rtt(&rl->can, p)) == NULL)
+		return 0;
+
+	frame_start(&f, rl->id, 0);
+	memcpy(f.point, p, sizeof(f.point));
+	frame_add_node(&f, &self);
+	frame_add(&f, "%s", k);
+	frame_add(&f, "%s", v);
+
+	if (peer_room(n) < WIRE_HDRLEN + f.len + REHOME_SLACK ||
+	    frame_send(n, CMD_PUT, &f) == -1)
+		return -1;
+	stats.kv_moved++;
+	return 1;
+}
+
+/* whether what we queued for the neighbors was all written */
+static int
+drained(void)
+{
+	struct can *c;
+	size_t i;
+	int r;
+
+	for (r = 0; r < nrealities; ++r) {
+		c = &realities[r].can;
+		for (i = 0; i < c->nneigh; ++i)
+			if (!peer_drained(c->nnode[i]))
+				return 0;
+	}
+	return 1;
+}
+
+static void
+leave_over(void)
+{
+	void (*done)(void) = leavedone;
+
+	leavedone = NULL;
+	timer_del(&leavetimer);
+	evtimer_del(&rehome_ev);
+	done();
+}
+
+static void
+leave_expired(void *d)
+{
+	log_warn("gave up handing our zones over after %d ms", LEAVE_MS);
+	leave_over();
+}
+
+/*
+ * Move the keys we don't own to their new owner.  When leaving, keep
+ * at it until every key and frame for the neighbors is written.
+ */
+static void
+rehome(void)
+{
+	struct timeval tv = { 0, REHOME_USEC };
+	int r, again = 0;
+
+	for (r = 0; r < nrealities; ++r)
+		if (kv_sweep(&realities[r].store, rehome_key,
+		    &realities[r]) == -1)
+			again = 1;
+	overlay_stats();
+
+	/* a sweep only stops on a full link, or on a broken one */
+	if (leavedone != NULL && drained()) {
+		leave_over();
+		return;
+	}
+	if (again || leavedone != NULL)
+		evtimer_add(&rehome_ev, &tv);
+}
+
+static void
+handle_rehome(int fd, short ev, void *d)
+{
+	stats_busy();
+	rehome();
+}
+
+/*
+ * The owner of the point gives a zone to the joining node and sends
+ * it its neighbors, us included.
+ */
+static void
+join(struct reality *rl, struct node *n, const uint64_t *p)
+{
+	static struct frame f;
+	struct can *c = &rl->can;
+	struct zone nz, z;
+	size_t i;
+
+	if (can_split(c, p, &nz) == -1) {
+		log_warn("can't split our zone for %s:%s", n->hostname,
+		    n->portno);
+		return;
+	}
+
+	log_info("node %s:%s joined reality %d", n->hostname, n->portno,
+	    rl->id);
+
+	frame_start(&f, rl->id, 0);
+	frame_add_zone(&f, &nz);
+	for (i = 0; i < c->nzones; ++i) {
+		frame_add_node(&f, &self);
+		frame_add_zone(&f, &c->zones[i]);
+	}
+	for (i = 0; i < c->nneigh; ++i) {
+		frame_add_node(&f, c->nnode[i]);
+		can_neighbor(c, i, &z);
+		frame_add_zone(&f, &z);
+	}
+	frame_send(n, CMD_WELCOME, &f);
+
+	/* the old neighbors have to know we shrank */
+	announce(rl);
+	can_prune(c);
+	can_update(c, n, &nz, 1);
+
+	/* and the keys in the zone we gave away go to n */
+	rl->store.cursor = 0;
+	rehome();
+}
+
+/* we got a zone: learn about our neighbors and say hello */
+static void
+welcome(struct wire *w)
+{
+	struct reality *rl;
+	struct args a;
+	struct node *n;
+	struct zone z;
+	int r;
+
+	args_init(&a, w);
+
+	if ((rl = wire_reality(w)) == NULL)
+		goto bad;
+
+	if (rl->can.nzones != 0) {
+		log_warn("unexpected WELCOME, we already have a zone");
+		return;
+	}
+
+	if (next_zone(&a, &z) == -1)
+		goto bad;
+	rl->can.zones[0] = z;
+	rl->can.nzones = 1;
+
+	while (a.p != a.end) {
+		if ((n = next_node(&a)) == NULL || next_zone(&a, &z) == -1)
+			goto bad;
+		if (can_add(&rl->can, n, &z) == -1)
+			log_warn("can_add failed");
+	}
+
+	log_info("joined reality %d, %zu neighbors", rl->id,
+	    rl->can.nneigh);
+	announce(rl);
+	overlay_stats();
+
+	/* the link we joined through is of no use after the last one */
+	for (r = 0; r < nrealities; ++r)
+		if (realities[r].can.nzones == 0)
+			return;
+	peer_close(&boot);
+	return;
+
+bad:
+	log_warn("malformed WELCOME frame");
+	overlay_stats();
+}
+
+static void
+update(struct wire *w)
+{
+	struct reality *rl;
+	struct args a;
+	struct node *n;
+	struct zone zs[CAN_MAXZONES];
+	size_t nz;
+
+	args_init(&a, w);
+
+	if ((rl = wire_reality(w)) == NULL || (n = next_node(&a)) == NULL)
+		goto bad;
+	for (nz = 0; a.p != a.end && nz < CAN_MAXZONES; ++nz)
+		if (next_zone(&a, &zs[nz]) == -1)
+			goto bad;
+
+	if (can_update(&rl->can, n, zs, nz) == -1)
+		log_warn("can_update failed");
+	overlay_stats();
+	return;
+
+bad:
+	log_warn("malformed UPDATE frame");
+}
+
+/*
+ * A neighbor is leaving rl: forget about it and let its heir have its
+ * zones.  If that's us they're taken over, together with the part of
+ * its neighbor table that's adjacent to them, unless we're leaving
+ * too.
+ */
+static void
+left(struct wire *w)
+{
+	struct reality *rl;
+	struct args a;
+	struct node *n, *h, *m;
+	struct zone zs[CAN_MAXZONES], z;
+	uint64_t nz;
+	size_t i;
+
+	args_init(&a, w);
+
+	if ((rl = wire_reality(w)) == NULL || (n = next_node(&a)) == NULL ||
+	    (h = next_node(&a)) == NULL || next_u64(&a, &nz) == -1 ||
+	    nz > CAN_MAXZONES)
+		goto bad;
+	for (i = 0; i < nz; ++i)
+		if (next_zone(&a, &zs[i]) == -1)
+			goto bad;
+	if (n == &self)
+		return;
+
+	log_info("node %s:%s left reality %d", n->hostname, n->portno,
+	    rl->id);
+	can_remove(&rl->can, n);
+
+	/* our own heir is leaving: its heir gets our keys instead */
+	if (rl->heir == n)
+		rl->heir = h != &self ? h : NULL;
+
+	if (h != &self || leavedone != NULL) {
+		for (i = 0; i < nz; ++i)
+			if (can_add(&rl->can, h, &zs[i]) == -1)
+				log_warn("can_add failed");
+	} else {
+		for (i = 0; i < nz; ++i) {
+			if (can_takeover(&rl->can, &zs[i]) == -1) {
+				log_warn("too many zones to take over");
+				continue;
+			}
+			stats.takeovers++;
+		}
+		while (a.p != a.end) {
+			if ((m = next_node(&a)) == NULL ||
+			    next_zone(&a, &z) == -1)
+				goto bad;
+			if (can_add(&rl->can, m, &z) == -1)
+				log_warn("can_add failed");
+		}
+		announce(rl);
+	}
+
+	/* it won't be back */
+	if (!seen_before(nrealities, n))
+		peer_close(n);
+	overlay_stats();
+	return;
+
+bad:
+	log_warn("malformed LEAVE frame");
+	overlay_stats();
+}
+
+/* deliver a FORWARD to our local subscribers */
+static void
+forward_local(struct args *a)
+{
+	char *to, *payload;
+
+	if ((to = next_arg(a)) == NULL || (payload = next_arg(a)) == NULL ||
+	    a->p != a->end) {
+		log_warn("malformed FORWARD frame");
+		return;
+	}
+
+	publish_msg(to, payload, strlen(payload));
+}
+
+static void
+join_local(struct reality *rl, struct args *a, const uint64_t *p)
+{
+	struct node *n;
+
+	if ((n = next_node(a)) == NULL || a->p != a->end) {
+		log_warn("malformed JOIN frame");
+		return;
+	}
+
+	join(rl, n, p);
+}
+
+/*
+ * A neighbor of a dead node that had the point: we know each other
+ * now, tell it about our zones.
+ */
+static void
+hello_local(struct reality *rl, struct args *a)
+{
+	static struct frame f;
+	struct node *n;
+	struct zone zs[CAN_MAXZONES];
+	size_t i, nz;
+
+	if ((n = next_node(a)) == NULL)
+		goto bad;
+	for (nz = 0; a->p != a->end && nz < CAN_MAXZONES; ++nz)
+		if (next_zone(a, &zs[nz]) == -1)
+			goto bad;
+	if (n == &self)
+		return;
+
+	if (can_update(&rl->can, n, zs, nz) == -1)
+		log_warn("can_update failed");
+	overlay_stats();
+
+	frame_start(&f, rl->id, 0);
+	frame_add_node(&f, &self);
+	for (i = 0; i < rl->can.nzones; ++i)
+		frame_add_zone(&f, &rl->can.zones[i]);
+	frame_send(n, CMD_UPDATE, &f);
+	return;
+
+bad:
+	log_warn("malformed HELLO frame");
+}
+
+/* a PUT, GET or DEL for a key we own */
+static void
+kv_local(struct reality *rl, enum cmd_type type, uint64_t reqid,
+    struct args *a)
+{
+	struct node *from;
+	char *k, *v = NULL;
+
+	if ((from = next_node(a)) == NULL || (k = next_arg(a)) == NULL ||
+	    (type == CMD_PUT && (v = next_arg(a)) == NULL) ||
+	    a->p != a->end) {
+		log_warn("malformed %s frame", cmd_name(type));
+		return;
+	}
+
+	serve(rl, type, k, v, reqid, from);
+}
+
+static void
+group_send(struct group *g, struct node *n, enum cmd_type type)
+{
+	static struct frame f;
+
+	frame_start(&f, 0, 0);
+	frame_add_node(&f, &self);
+	frame_add(&f, "%s", g->name);
+	frame_send(n, type, &f);
+}
+
+/*
+ * Subscribe to the next hop towards the rendezvous of g, unless we
+ * are it, and leave the previous parent if that changed.  If there's
+ * no route yet the old parent is kept.
+ */
+static void
+group_subscribe(struct group *g)
+{
+	struct can *c = &realities[0].can;
+	struct node *n = NULL;
+	uint64_t p[CAN_DIMS];
+
+	key_point(g->name, g->len, p);
+	if (!can_owns(c, p) && (n = route_next(c, p)) == NULL)
+		return;
+
+	if (g->parent != NULL && g->parent != n)
+		group_send(g, g->parent, CMD_UNSUBSCRIBE);
+	g->parent = n;
+	if (n != NULL)
+		group_send(g, n, CMD_SUBSCRIBE);
+}
+
+/* drop g if nobody's interested in it anymore */
+static int
+group_gc(struct group *g)
+{
+	if (g->local != 0 || g->nchildren != 0)
+		return 0;
+
+	if (g->parent != NULL)
+		group_send(g, g->parent, CMD_UNSUBSCRIBE);
+	group_del(&groups, g);
+	stats.groups = groups.count;
+	return 1;
+}
+
+/*
+ * Pass a publish down the tree of its topic, delivering it here too
+ * unless it's where it was sent from.  w becomes a DELIVER.
+ */
+static void
+multicast(struct wire *w, struct args *a)
+{
+	struct group *g;
+	uint64_t origin, now;
+	size_t i;
+	char *to, *payload;
+
+	if (next_u64(a, &origin) == -1 || (to = next_arg(a)) == NULL ||
+	    (payload = next_arg(a)) == NULL || a->p != a->end) {
+		log_warn("malformed %s frame", cmd_name(w->type));
+		return;
+	}
+
+	now = stats_now();
+	if (dedup_seen(&msgseen, w->id, now)) {
+		stats.mcast_dups++;
+		return;
+	}
+
+	if ((g = group_find(&groups, to)) == NULL)
+		return;
+
+	if (origin != self.id && g->local != 0) {
+		publish_msg(to, payload, strlen(payload));
+		stats.mcast_recv++;
+	}
+
+	group_expire(g, now);
+	w->type = CMD_DELIVER;
+	w->hops = 0;
+	for (i = 0; i < g->nchildren; ++i)
+		if (wire_send(g->children[i].node, w) == 0)
+			stats.mcast_sent++;
+	group_gc(g);
+}
+
+/* tell whoever sent a request we're dropping that it's lost */
+static void
+unroutable(struct wire *w, struct args *a)
+{
+	struct node *from;
+
+	if (w->type != CMD_PUT && w->type != CMD_GET && w->type != CMD_DEL)
+		return;
+	if ((from = next_node(a)) == NULL)
+		return;
+	result(from, w->id, CMD_ERROR, "no route to the key");
+}
+
+/*
+ * A routed frame is handled here if we own its point, otherwise it's
+ * passed to the next hop with the hop count bumped.
+ */
+static void
+routed(struct wire *w)
+{
+	struct reality *rl;
+	struct args a;
+	struct node *n;
+
+	args_init(&a, w);
+
+	if ((rl = wire_reality(w)) == NULL) {
+		log_warn("malformed %s frame", cmd_name(w->type));
+		return;
+	}
+
+	if (can_owns(&rl->can, w->point)) {
+		if (w->type == CMD_FORWARD)
+			forward_local(&a);
+		else if (w->type == CMD_PUBLISH)
+			multicast(w, &a);
+		else if (w->type == CMD_HELLO)
+			hello_local(rl, &a);
+		else if (w->type == CMD_JOIN)
+			join_local(rl, &a, w->point);
+		else
+			kv_local(rl, w->type, w->id, &a);
+		return;
+	}
+
+	if ((n = route_next_rtt(&rl->can, w->point)) == NULL) {
+		log_info("no route for a %s frame", cmd_name(w->type));
+		stats.route_drops++;
+		unroutable(w, &a);
+		return;
+	}
+
+	if (w->hops >= ROUTE_MAXHOPS) {
+		log_info("dropping a %s frame after %d hops",
+		    cmd_name(w->type), w->hops);
+		stats.route_drops++;
+		unroutable(w, &a);
+		return;
+	}
+
+	w->hops++;
+	if (wire_send(n, w) == 0)
+		stats.forwarded++;
+}
+
+/*
+ * Start a request for the key k in reality rl.  It's served right
+ * away if we own its point, otherwise it's routed as a frame.
+ */
+static void
+request_in(struct reality *rl, enum cmd_type type, const char *k,
+    const char *v, uint64_t reqid)
+{
+	static struct frame f;
+	struct wire w;
+	uint64_t p[CAN_DIMS];
+
+	key_point(k, strlen(k), p);
+	key_reality(p, rl->id);
+	if (can_owns(&rl->can, p)) {
+		serve(rl, type, k, v, reqid, &self);
+		return;
+	}
+
+	frame_start(&f, rl->id, reqid);
+	memcpy(f.point, p, sizeof(f.point));
+	frame_add_node(&f, &self);
+	frame_add(&f, "%s", k);
+	if (v != NULL)
+		frame_add(&f, "%s", v);
+	if (f.len > sizeof(f.data)) {
+		result(&self, reqid, CMD_ERROR, "request too long");
+		return;
+	}
+
+	frame_wire(&f, type, &w);
+	routed(&w);
+}
+
+static void
+pending_free(struct pending *pd)
+{
+	timer_del(&pd->timer);
+	LIST_REMOVE(pd, entry);
+	pool_put(&pendingpool, pd);
+}
+
+/*
+ * Send the GET of pd along the reality we haven't tried yet where
+ * we're the closest to the key, or give up if there's none left.
+ */
+static void
+pending_next(struct pending *pd)
+{
+	struct reality *rl = NULL;
+	uint64_t p[CAN_DIMS], p0[CAN_DIMS], hi, lo, besthi, bestlo;
+	int r;
+
+	besthi = bestlo = UINT64_MAX;
+	key_point(pd->key, strlen(pd->key), p0);
+	for (r = 0; r < nrealities; ++r) {
+		if (pd->tried & (1U << r))
+			continue;
+		memcpy(p, p0, sizeof(p));
+		key_reality(p, r);
+		route_dist(&realities[r].can, p, &hi, &lo);
+		if (rl == NULL || hi < besthi || (hi == besthi && lo < bestlo)) {
+			rl = &realities[r];
+			besthi = hi;
+			bestlo = lo;
+		}
+	}
+
+	if (rl == NULL) {
+		kv_answer(pd->reqid, CMD_ERROR, "no such key");
+		pending_free(pd);
+		return;
+	}
+
+	pd->tried |= 1U << rl->id;
+	pd->waiting = 1U << rl->id;
+	timer_add(&pd->timer, PENDING_MS);
+	request_in(rl, pd->type, pd->key, NULL, PENDING_ID(pd->id, rl->id));
+}
+
+/*
+ * One of the realities answered the request id.  A GET is answered
+ * by the first reality that has the key, a PUT only if it's stored
+ * in all of them and a DEL if it was in any.  The answers that come
+ * after their reality timed out are ignored.
+ */
+static void
+pending_answer(uint64_t id, enum cmd_type status, const char *v)
+{
+	static char err[64];
+	struct pending *pd;
+	unsigned int bit;
+
+	LIST_FOREACH(pd, &pendings, entry)
+		if (pd->id == id >> PENDING_RBITS)
+			break;
+	bit = 1U << (id & ((1U << PENDING_RBITS) - 1));
+	if (pd == NULL || !(pd->waiting & bit)) {
+		log_debug("answer for an unknown request %llx",
+		    (unsigned long long)id);
+		return;
+	}
+
+	pd->waiting &= ~bit;
+	if (status == CMD_OK)
+		pd->ok++;
+
+	if (pd->type == CMD_GET && status == CMD_OK && !pd->done) {
+		kv_answer(pd->reqid, CMD_OK, v);
+		pd->done = 1;
+	}
+
+	if (pd->waiting != 0)
+		return;
+
+	if (pd->type == CMD_GET && !pd->done && !racing) {
+		pending_next(pd);
+		return;
+	}
+
+	if (!pd->done) {
+		switch (pd->type) {
+		case CMD_PUT:
+			if (pd->ok == nrealities) {
+				kv_answer(pd->reqid, CMD_OK, NULL);
+				break;
+			}
+			snprintf(err, sizeof(err),
+			    "stored in %d out of %d realities", pd->ok,
+			    nrealities);
+			kv_answer(pd->reqid, CMD_ERROR, err);
+			break;
+		case CMD_DEL:
+			if (pd->ok != 0)
+				kv_answer(pd->reqid, CMD_OK, NULL);
+			else
+				kv_answer(pd->reqid, CMD_ERROR, v);
+			break;
+		default:
+			kv_answer(pd->reqid, CMD_ERROR, v);
+			break;
+		}
+	}
+	pending_free(pd);
+}
+
+/*
+ * The realities that didn't answer pd in time count as failed: a GET
+ * moves on to the next reality, the others are over.
+ */
+static void
+pending_expired(void *d)
+{
+	struct pending *pd = d;
+	uint64_t id = pd->id;
+	unsigned int waiting = pd->waiting;
+	int r;
+
+	stats.kv_timeouts++;
+
+	/* pd is gone after the last one */
+	for (r = 0; waiting != 0; ++r, waiting >>= 1)
+		if (waiting & 1)
+			pending_answer(PENDING_ID(id, r), CMD_ERROR,
+			    "timed out");
+}
+
+/*
+ * Start a request for a ctl.  With more than one reality, PUTs and
+ * DELs go to all of them; GETs too when racing, otherwise to one at
+ * a time.
+ */
+static void
+request(enum cmd_type type, const char *k, const char *v, uint64_t reqid)
+{
+	struct pending *pd;
+	uint64_t id;
+	size_t klen;
+	int r;
+
+	if (nrealities == 1) {
+		request_in(&realities[0], type, k, v, reqid);
+		return;
+	}
+
+	if ((klen = strlen(k)) > KV_MAXKEY) {
+		kv_answer(reqid, CMD_ERROR, "key too long");
+		return;
+	}
+	if ((pd = pool_get(&pendingpool)) == NULL) {
+		kv_answer(reqid, CMD_ERROR, "out of memory");
+		return;
+	}
+	pd->id = id = ++pendingseq;
+	pd->reqid = reqid;
+	pd->type = type;
+	pd->tried = 0;
+	pd->ok = 0;
+	pd->done = 0;
+	memcpy(pd->key, k, klen + 1);
+	timer_set(&pd->timer, pending_expired, pd);
+	LIST_INSERT_HEAD(&pendings, pd, entry);
+
+	if (type == CMD_GET && !racing) {
+		pending_next(pd);
+		return;
+	}
+
+	/*
+	 * The answers may come while we're still sending: pd is freed
+	 * after the last one, so don't touch it in the loop.
+	 */
+	pd->tried = pd->waiting = (1U << nrealities) - 1;
+	timer_add(&pd->timer, PENDING_MS);
+	for (r = 0; r < nrealities; ++r)
+		request_in(&realities[r], type, k, v, PENDING_ID(id, r));
+}
+
+/* the answer to one of our requests */
+static void
+answered(struct wire *w)
+{
+	struct args a;
+	uint64_t status;
+	char *v;
+
+	args_init(&a, w);
+
+	if (next_u64(&a, &status) == -1 ||
+	    (status != CMD_OK && status != CMD_ERROR)) {
+		log_warn("malformed RESULT frame");
+		return;
+	}
+	v = next_arg(&a);
+	if (a.p != a.end) {
+		log_warn("malformed RESULT frame");
+		return;
+	}
+
+	answer(w->id, status, v);
+}
+
+/* a broadcast being passed on */
+struct bcast {
+	uint64_t	 id;
+	const uint64_t	*origin;
+	const char	*to;
+	const char	*payload;
+};
+
+static void
+flood_send(struct node *n, int axis, int side, void *d)
+{
+	static struct frame f;
+	struct bcast *b = d;
+
+	frame_start(&f, 0, b->id);
+	memcpy(f.point, b->origin, sizeof(f.point));
+	frame_add(&f, "%x", axis);
+	frame_add(&f, "%d", side == 1);
+	frame_add(&f, "%s", b->to);
+	frame_add(&f, "%s", b->payload);
+	if (frame_send(n, CMD_BROADCAST, &f) == 0)
+		stats.bcast_sent++;
+}
+
+/* deliver a broadcast here and start flooding it from our zone */
+static void
+broadcast(const char *to, const char *payload)
+{
+	struct can *c = &realities[0].can;
+	struct bcast b;
+	uint64_t o[CAN_DIMS];
+
+	publish_msg(to, payload, strlen(payload));
+	stats.bcast_recv++;
+
+	if (c->nzones == 0)
+		return;
+
+	zone_center(&c->zones[0], o);
+
+	do
+		b.id = (uint64_t)arc4random() << 32 | arc4random();
+	while (b.id == 0);
+	dedup_seen(&msgseen, b.id, stats_now());
+
+	b.origin = o;
+	b.to = to;
+	b.payload = payload;
+	route_flood(c, o, CAN_DIMS, 0, flood_send, &b);
+}
+
+static void
+broadcasted(struct wire *w)
+{
+	struct args a;
+	struct bcast b;
+	uint64_t axis, side;
+
+	args_init(&a, w);
+
+	if (w->reality != 0 || next_u64(&a, &axis) == -1 ||
+	    axis >= CAN_DIMS || next_u64(&a, &side) == -1 ||
+	    (b.to = next_arg(&a)) == NULL ||
+	    (b.payload = next_arg(&a)) == NULL || a.p != a.end) {
+		log_warn("malformed BROADCAST frame");
+		return;
+	}
+
+	if (dedup_seen(&msgseen, w->id, stats_now())) {
+		stats.bcast_dups++;
+		return;
+	}
+
+	publish_msg(b.to, b.payload, strlen(b.payload));
+	stats.bcast_recv++;
+
+	b.id = w->id;
+	b.origin = w->point;
+	route_flood(&realities[0].can, w->point, axis, side ? 1 : -1,
+	    flood_send, &b);
+}
+
+static void
+subscribed(struct wire *w)
+{
+	struct group *g;
+	struct args a;
+	struct node *n;
+	char *to;
+	int fresh;
+
+	args_init(&a, w);
+
+	if (w->reality != 0 || (n = next_node(&a)) == NULL ||
+	    (to = next_arg(&a)) == NULL || a.p != a.end || n == &self) {
+		log_warn("malformed %s frame", cmd_name(w->type));
+		return;
+	}
+
+	if (w->type == CMD_UNSUBSCRIBE) {
+		if ((g = group_find(&groups, to)) != NULL) {
+			group_leave(g, n);
+			group_gc(g);
+		}
+		return;
+	}
+
+	if ((g = group_get(&groups, to)) == NULL) {
+		log_warn("group_get failed");
+		return;
+	}
+	stats.groups = groups.count;
+
+	fresh = g->local == 0 && g->nchildren == 0;
+	if (group_join(g, n, stats_now() + GROUP_EXPIRE_SEC * 1000000000ULL)
+	    == -1) {
+		log_warn("group_join failed");
+		group_gc(g);
+		return;
+	}
+
+	/* a new branch: join the tree if we aren't part of it */
+	if (fresh || g->parent == NULL)
+		group_subscribe(g);
+}
+
+/* route a publish of ours to the rendezvous of its topic */
+static void
+publish_remote(const char *to, const char *payload)
+{
+	static struct frame f;
+	struct wire w;
+	uint64_t id;
+
+	do
+		id = (uint64_t)arc4random() << 32 | arc4random();
+	while (id == 0);
+
+	frame_start(&f, 0, id);
+	key_point(to, strlen(to), f.point);
+	frame_add(&f, "%016llx", (unsigned long long)self.id);
+	frame_add(&f, "%s", to);
+	frame_add(&f, "%s", payload);
+	if (f.len > sizeof(f.data)) {
+		log_warn("PUBLISH frame too long");
+		return;
+	}
+
+	frame_wire(&f, CMD_PUBLISH, &w);
+	routed(&w);
+}
+
+static void
+delivered(struct wire *w)
+{
+	struct args a;
+
+	args_init(&a, w);
+	multicast(w, &a);
+}
+
+/* the local subscribers of a topic came or went on some worker */
+static void
+interest(const char *to, int on)
+{
+	struct group *g;
+
+	if (!on) {
+		if ((g = group_find(&groups, to)) != NULL && g->local > 0) {
+			g->local--;
+			group_gc(g);
+		}
+		return;
+	}
+
+	if ((g = group_get(&groups, to)) == NULL) {
+		log_warn("group_get failed");
+		return;
+	}
+	stats.groups = groups.count;
+
+	if (g->local++ == 0 && g->nchildren == 0)
+		group_subscribe(g);
+}
+
+/* subscribe again to the parents, so the trees follow the overlay */
+static void
+handle_refresh(void *d)
+{
+	struct group *g, *next;
+	uint64_t now;
+
+	now = stats_now();
+	for (g = LIST_FIRST(&groups.all); g != NULL; g = next) {
+		next = LIST_NEXT(g, entry);
+		group_expire(g, now);
+		if (!group_gc(g))
+			group_subscribe(g);
+	}
+
+	timer_add(&refresh, GROUP_REFRESH_SEC * 1000);
+}
+
+static void
+handle_frame(struct wire *w)
+{
+	switch (w->type) {
+	case CMD_FORWARD:
+	case CMD_PUBLISH:
+	case CMD_HELLO:
+	case CMD_JOIN:
+	case CMD_PUT:
+	case CMD_GET:
+	case CMD_DEL:
+		routed(w);
+		break;
+	case CMD_WELCOME:
+		welcome(w);
+		break;
+	case CMD_UPDATE:
+		update(w);
+		break;
+	case CMD_RESULT:
+		answered(w);
+		break;
+	case CMD_PROBE:
+		probed(w);
+		break;
+	case CMD_ECHO:
+		echoed(w);
+		break;
+	case CMD_BROADCAST:
+		broadcasted(w);
+		break;
+	case CMD_SUBSCRIBE:
+	case CMD_UNSUBSCRIBE:
+		subscribed(w);
+		break;
+	case CMD_DELIVER:
+		delivered(w);
+		break;
+	case CMD_LEAVE:
+		left(w);
+		break;
+	default:
+		log_warn("unexpected %s frame on the overlay",
+		    cmd_name(w->type));
+		break;
+	}
+}
+
+static void
+handle_posted(void *d)
+{
+	handle_frame(d);
+	free(d);
+}
+
+/*
+ * Hand an overlay frame over to worker 0.  The frame has to stay
+ * valid only for the duration of the call.
+ */
+void
+overlay_post(struct wire *w)
+{
+	struct wire *c;
+
+	if (worker->id == 0) {
+		handle_frame(w);
+		return;
+	}
+
+	if ((c = wire_dup(w)) == NULL) {
+		log_warn("overlay_post: wire_dup failed");
+		return;
+	}
+
+	if (worker_post(&workers[0], handle_posted, c) == -1) {
+		log_warn("overlay_post: worker_post");
+		stats.handoff_drops++;
+		free(c);
+		return;
+	}
+	worker_kick(&workers[0]);
+}
+
+/*
+ * A FORWARD from a ctl: point... to payload, routed along the first
+ * reality.  Returns -1 if it's malformed.
+ */
+int
+overlay_forward(struct cmd *cmd)
+{
+	struct args a;
+	struct wire w;
+
+	a.p = cmd->data;
+	a.end = cmd->data + cmd->len;
+
+	memset(&w, 0, sizeof(w));
+	w.type = CMD_FORWARD;
+	if (next_point(&a, w.point) == -1)
+		return -1;
+	w.data = a.p;
+	w.len = a.end - a.p;
+	if (next_arg(&a) == NULL || next_arg(&a) == NULL || a.p != a.end)
+		return -1;
+
+	overlay_post(&w);
+	return 0;
+}
+
+static void
+handle_bcastreq(void *d)
+{
+	char *to = d;
+
+	broadcast(to, to + strlen(to) + 1);
+	free(d);
+}
+
+/*
+ * Send payload to the subscribers of to on every node.  Returns -1
+ * if out of memory.
+ */
+int
+overlay_broadcast(const char *to, const char *payload)
+{
+	size_t tlen, plen;
+	char *d;
+
+	if (worker->id == 0) {
+		broadcast(to, payload);
+		return 0;
+	}
+
+	tlen = strlen(to) + 1;
+	plen = strlen(payload) + 1;
+	if ((d = malloc(tlen + plen)) == NULL)
+		return -1;
+	memcpy(d, to, tlen);
+	memcpy(d + tlen, payload, plen);
+
+	if (worker_post(&workers[0], handle_bcastreq, d) == -1) {
+		stats.handoff_drops++;
+		free(d);
+		return -1;
+	}
+	worker_kick(&workers[0]);
+	return 0;
+}
+
+static void
+handle_publishreq(void *d)
+{
+	struct cmd *cmd = d;
+	char *p, *to;
+
+	for (p = cmd->data; p != cmd->data + cmd->len; p += strlen(p) + 1) {
+		to = p;
+		p += strlen(p) + 1;
+		publish_remote(to, p);
+	}
+	free(cmd);
+}
+
+/*
+ * Send the (to, payload) pairs of a SEND or SEND_BATCH, already
+ * published here, to the subscribers on the other nodes.  Returns
+ * -1 if out of memory.
+ */
+int
+overlay_publish(struct cmd *cmd)
+{
+	struct cmd *c;
+
+	if (__atomic_load_n(&alone, __ATOMIC_RELAXED))
+		return 0;
+
+	if ((c = malloc(sizeof(*c) + cmd->len)) == NULL)
+		return -1;
+	c->data = (char *)(c + 1);
+	c->len = cmd->len;
+	memcpy(c->data, cmd->data, cmd->len);
+
+	if (worker->id == 0) {
+		handle_publishreq(c);
+		return 0;
+	}
+
+	if (worker_post(&workers[0], handle_publishreq, c) == -1) {
+		stats.handoff_drops++;
+		free(c);
+		return -1;
+	}
+	worker_kick(&workers[0]);
+	return 0;
+}
+
+/* a topic that got its first or lost its last subscriber on a worker */
+struct interestreq {
+	int	 on;
+	char	 to[];
+};
+
+static void
+handle_interestreq(void *d)
+{
+	struct interestreq *r = d;
+
+	interest(r->to, r->on);
+	free(r);
+}
+
+/*
+ * The subscribers of the topic to on this worker started or stopped
+ * being, as on says.  Returns -1 if out of memory.
+ */
+int
+overlay_interest(const char *to, int on)
+{
+	struct interestreq *r;
+	size_t len;
+
+	if (worker->id == 0) {
+		interest(to, on);
+		return 0;
+	}
+
+	len = strlen(to) + 1;
+	if ((r = malloc(sizeof(*r) + len)) == NULL)
+		return -1;
+	r->on = on;
+	memcpy(r->to, to, len);
+
+	if (worker_post(&workers[0], handle_interestreq, r) == -1) {
+		stats.handoff_drops++;
+		free(r);
+		return -1;
+	}
+	worker_kick(&workers[0]);
+	return 0;
+}
+
+/* a request from a ctl of another worker */
+struct kvreq {
+	enum cmd_type	 type;
+	uint64_t	 reqid;
+	char		*value;
+	char		 key[];
+};
+
+static void
+handle_kvreq(void *d)
+{
+	struct kvreq *r = d;
+
+	request(r->type, r->key, r->value, r->reqid);
+	free(r);
+}
+
+/*
+ * Run a PUT, GET or DEL (value is NULL for the latter two) for a
+ * ctl.  The outcome is given to kv_answer with reqid, possibly even
+ * before this returns.  Returns -1 if out of memory.
+ */
+int
+overlay_kv(enum cmd_type type, const char *key, const char *value,
+    uint64_t reqid)
+{
+	struct kvreq *r;
+	size_t klen, vlen;
+
+	if (worker->id == 0) {
+		request(type, key, value, reqid);
+		return 0;
+	}
+
+	klen = strlen(key) + 1;
+	vlen = value != NULL ? strlen(value) + 1 : 0;
+	if ((r = malloc(sizeof(*r) + klen + vlen)) == NULL)
+		return -1;
+	r->type = type;
+	r->reqid = reqid;
+	memcpy(r->key, key, klen);
+	r->value = NULL;
+	if (value != NULL) {
+		r->value = r->key + klen;
+		memcpy(r->value, value, vlen);
+	}
+
+	if (worker_post(&workers[0], handle_kvreq, r) == -1) {
+		stats.handoff_drops++;
+		free(r);
+		return -1;
+	}
+	worker_kick(&workers[0]);
+	return 0;
+}
+
+/*
+ * Called by worker 0.  We're reachable at host:port; if join is
+ * not NULL it's the host:port of a node of the overlay we want to
+ * join, otherwise we start a new overlay.  We take part in nreal
+ * realities, and if race is set GETs are sent along all of them.
+ */
+void
+overlay_init(const char *host, const char *port, const char *join,
+    int nreal, int race)
+{
+	static struct frame f;
+	char *h, *s;
+	int r;
+
+	if (nreal < 1 || nreal > OVERLAY_MAXREALITIES)
+		errx(1, "can't take part in %d realities", nreal);
+	nrealities = nreal;
+	racing = race;
+
+	LIST_INIT(&nodes);
+	LIST_INIT(&pendings);
+	if (pool_init(&nodepool, "node", sizeof(struct neighbor)) == -1 ||
+	    pool_init(&pendingpool, "pending", sizeof(struct pending)) == -1)
+		err(1, "pool_init");
+	resolv_init();
+	peer_init(handle_frame);
+	dedup_init(&msgseen);
+	if (groups_init(&groups) == -1)
+		err(1, "groups_init");
+	for (r = 0; r < nrealities; ++r) {
+		realities[r].id = r;
+		if (kv_init(&realities[r].store) == -1)
+			err(1, "kv_init");
+	}
+	worker_event_set(&rehome_ev, -1, 0, handle_rehome, NULL);
+	timer_set(&refresh, handle_refresh, NULL);
+	timer_add(&refresh, GROUP_REFRESH_SEC * 1000);
+
+	arc4random_buf(&self.id, sizeof(self.id));
+	self.hostname = host;
+	self.portno = port;
+	for (r = 0; r < nrealities; ++r)
+		can_init(&realities[r].can, &self);
+
+	if (join == NULL) {
+		for (r = 0; r < nrealities; ++r)
+			can_bootstrap(&realities[r].can);
+		overlay_stats();
+		log_debug("node %016llx owns the whole space",
+		    (unsigned long long)self.id);
+		return;
+	}
+
+	if ((h = strdup(join)) == NULL)
+		err(1, "strdup");
+	if ((s = strrchr(h, ':')) == NULL)
+		errx(1, "missing port in %s", join);
+	*s++ = '\0';
+	boot.hostname = h;
+	boot.portno = s;
+
+	/* our zones will be around random points */
+	for (r = 0; r < nrealities; ++r) {
+		frame_start(&f, r, 0);
+		random_point(f.point);
+		frame_add_node(&f, &self);
+		if (frame_send(&boot, CMD_JOIN, &f) == -1)
+			errx(1, "can't join the overlay through %s", join);
+	}
+}
+
+/*
+ * Called by worker 0 when we're shutting down: hand each of our
+ * zones over to the successor in its reality, and our keys with
+ * them.  done is called once they're on their way, or after LEAVE_MS
+ * if they can't be.
+ */
+void
+overlay_leave(void (*done)(void))
+{
+	static struct frame f;
+	struct reality *rl;
+	struct can *c;
+	struct node *h;
+	struct zone z;
+	size_t i;
+	int r;
+
+	for (r = 0; r < nrealities; ++r) {
+		rl = &realities[r];
+		c = &rl->can;
+		if (c->nzones == 0 || (h = can_successor(c)) == NULL)
+			continue;
+
+		frame_start(&f, rl->id, 0);
+		frame_add_node(&f, &self);
+		frame_add_node(&f, h);
+		frame_add(&f, "%zx", c->nzones);
+		for (i = 0; i < c->nzones; ++i)
+			frame_add_zone(&f, &c->zones[i]);
+		for (i = 0; i < c->nneigh; ++i) {
+			frame_add_node(&f, c->nnode[i]);
+			can_neighbor(c, i, &z);
+			frame_add_zone(&f, &z);
+		}
+		send_neighbors(rl, CMD_LEAVE, &f);
+
+		log_info("leaving reality %d to %s:%s", rl->id, h->hostname,
+		    h->portno);
+		c->nzones = 0;
+		rl->heir = h;
+		rl->store.cursor = 0;
+	}
+
+	leavedone = done;
+	timer_set(&leavetimer, leave_expired, NULL);
+	timer_add(&leavetimer, LEAVE_MS);
+	rehome();
+}
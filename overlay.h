@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_OVERLAY_H
+#define HIRO_OVERLAY_H
+
+#include "cmd.h"
+#include "wire.h"
+
+/* most independent overlays a node can take part in */
+#define OVERLAY_MAXREALITIES	8
+
+/*
+ * The CAN overlay, and the keys stored in our zones.  Its state is
+ * owned by worker 0: the other workers hand the overlay frames and
+ * the requests they receive over to it.
+ */
+void		 overlay_init(const char*, const char*, const char*, int, int);
+void		 overlay_post(struct wire*);
+int		 overlay_forward(struct cmd*);
+int		 overlay_broadcast(const char*, const char*);
+int		 overlay_publish(struct cmd*);
+int		 overlay_interest(const char*, int);
+int		 overlay_kv(enum cmd_type, const char*, const char*, uint64_t);
+void		 overlay_leave(void (*)(void));
+
+#endif
@@ -0,0 +1,523 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "can.h"
+#include "hiro.h"
+#include "log.h"
+#include "peer.h"
+#include "pool.h"
+#include "resolv.h"
+#include "stats.h"
+#include "util.h"
+
+#include "err.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/* reconnect after 100ms, doubling up to 30s */
+#define PEER_MINBACKOFF	100
+#define PEER_MAXBACKOFF	(30 * 1000)
+
+/* give up on a connect after this many ms */
+#define PEER_CONNECTMS	(3 * 1000)
+
+/*
+ * All of this belongs to worker 0, like the overlay.  Frames that
+ * arrive on our own links are passed to handler.
+ */
+static struct pool	 peerpool, peerbufpool;
+static LIST_HEAD(, peer) peers;
+static LIST_HEAD(, peer) dirty;		/* to flush before sleeping */
+static void		(*handler)(struct wire*);
+static struct event	 rate_ev;
+static uint64_t		 lastflushes;
+
+unsigned int		 peer_linger = PEER_LINGER;
+size_t			 peer_flushbytes = PEER_FLUSHBYTES;
+
+static void	peer_connect(struct peer*);
+static void	peer_fail(struct peer*, const char*, int);
+
+/* the buffer in *bp, taken from the pool the first time it's needed */
+static struct cmdbuf *
+peer_buf(struct cmdbuf **bp)
+{
+	if (*bp == NULL && (*bp = pool_get(&peerbufpool)) != NULL)
+		(*bp)->off = (*bp)->len = 0;
+	return *bp;
+}
+
+/* give the buffer in *bp back to the pool if there's nothing in it */
+static void
+peer_buf_trim(struct cmdbuf **bp)
+{
+	if (*bp != NULL && (*bp)->off == (*bp)->len) {
+		pool_put(&peerbufpool, *bp);
+		*bp = NULL;
+	}
+}
+
+static void
+peer_free(struct peer *p)
+{
+	if (p->in != NULL)
+		pool_put(&peerbufpool, p->in);
+	if (p->out != NULL)
+		pool_put(&peerbufpool, p->out);
+	pool_put(&peerpool, p);
+}
+
+/* the backoff is over, or the connect is taking too long */
+static void
+peer_timeout(void *d)
+{
+	struct peer *p = d;
+
+	if (p->state == PEER_DOWN)
+		peer_connect(p);
+	else if (p->state == PEER_CONNECTING) {
+		stats.peer_timeouts++;
+		peer_fail(p, "connect", ETIMEDOUT);
+	}
+}
+
+/*
+ * The link is broken: close it and try again later.  If a frame may
+ * have been only partially written there's no way to resync, so the
+ * queue is dropped; otherwise it's kept for the next connection.
+ */
+static void
+peer_fail(struct peer *p, const char *what, int error)
+{
+	if (p->failures++ == 0)
+		log_warn("link to %s:%s down: %s: %s", p->node->hostname,
+		    p->node->portno, what, strerror(error));
+
+	if (p->state == PEER_UP)
+		stats.peers_up--;
+	stats.peer_failures++;
+
+	if (p->lingering) {
+		evtimer_del(&p->linger);
+		p->lingering = 0;
+	}
+
+	if (p->fd != -1) {
+		event_del(&p->rev);
+		event_del(&p->wev);
+		close(p->fd);
+		p->fd = -1;
+	}
+	p->ai = 0;
+
+	if (p->partial) {
+		stats.peer_drops++;
+		p->out->off = p->out->len = 0;
+		p->partial = 0;
+		peer_buf_trim(&p->out);
+	}
+
+	/* peer_read is still using it if we're in the handler */
+	if (p->in != NULL) {
+		p->in->off = p->in->len = 0;
+		if (!p->reading)
+			peer_buf_trim(&p->in);
+	}
+
+	p->state = PEER_DOWN;
+	if (p->backoff == 0)
+		p->backoff = PEER_MINBACKOFF;
+	else if ((p->backoff *= 2) > PEER_MAXBACKOFF)
+		p->backoff = PEER_MAXBACKOFF;
+
+	timer_add(&p->timer, p->backoff);
+}
+
+/* write all the frames queued so far with a single write */
+static void
+peer_flush(struct peer *p)
+{
+	ssize_t r;
+
+	if (p->lingering) {
+		evtimer_del(&p->linger);
+		p->lingering = 0;
+	}
+
+	if (p->out != NULL && p->out->off != p->out->len) {
+		stats.peer_flushes++;
+		r = cmdbuf_write(p->fd, p->out);
+		if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR) {
+			peer_fail(p, "write", errno);
+			return;
+		}
+		if (r > 0)
+			p->partial = 1;
+	}
+
+	if (p->out == NULL || p->out->off == p->out->len) {
+		p->partial = 0;
+		event_del(&p->wev);
+		peer_buf_trim(&p->out);
+	} else
+		event_add(&p->wev, NULL);
+}
+
+static void
+peer_lingered(int fd, short ev, void *d)
+{
+	struct peer *p = d;
+
+	stats_busy();
+	p->lingering = 0;
+	if (p->state == PEER_UP)
+		peer_flush(p);
+}
+
+static void
+peer_read(int fd, short ev, void *d)
+{
+	struct peer *p = d;
+	struct wire w;
+	ssize_t r;
+
+	stats_busy();
+
+	if (peer_buf(&p->in) == NULL) {
+		peer_fail(p, "read", ENOMEM);
+		return;
+	}
+
+	if ((r = cmdbuf_read(fd, p->in)) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			peer_buf_trim(&p->in);
+			return;
+		}
+		peer_fail(p, "read", errno);
+		return;
+	}
+
+	for (;;) {
+		switch (wire_recv(p->in, &w)) {
+		case 1:
+			p->reading = 1;
+			handler(&w);
+			p->reading = 0;
+			/* the handler may have closed or broken the link */
+			if (p->node == NULL) {
+				peer_free(p);
+				return;
+			}
+			if (p->fd != fd) {
+				peer_buf_trim(&p->in);
+				return;
+			}
+			continue;
+		case -1:
+			peer_fail(p, "read", EBADMSG);
+			return;
+		}
+		break;
+	}
+
+	if (r == 0)
+		peer_fail(p, "read", ECONNRESET);
+	else
+		peer_buf_trim(&p->in);
+}
+
+static void
+peer_write(int fd, short ev, void *d)
+{
+	struct peer *p = d;
+	socklen_t len;
+	int error;
+
+	stats_busy();
+
+	if (p->state == PEER_CONNECTING) {
+		len = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+			error = errno;
+		if (error != 0 && p->ai < p->naddrs) {
+			/* try the next address */
+			event_del(&p->wev);
+			close(p->fd);
+			p->fd = -1;
+			peer_connect(p);
+			return;
+		}
+		if (error != 0) {
+			peer_fail(p, "connect", error);
+			return;
+		}
+
+		if (p->failures != 0)
+			log_info("link to %s:%s up again", p->node->hostname,
+			    p->node->portno);
+		timer_del(&p->timer);
+		p->state = PEER_UP;
+		p->failures = 0;
+		p->backoff = 0;
+		stats.peers_up++;
+		stats.peer_connects++;
+		event_add(&p->rev, NULL);
+	}
+
+	peer_flush(p);
+}
+
+/* start a non-blocking connect to the first address that takes it */
+static void
+peer_resolved(void *d, int error, const struct resolv_addr *addrs, size_t n)
+{
+	struct peer *p = d;
+	const struct resolv_addr *a;
+	int fd;
+
+	/* peer_close while it was being looked up */
+	if (p->node == NULL) {
+		peer_free(p);
+		return;
+	}
+
+	if (error != 0) {
+		peer_fail(p, "lookup", EHOSTUNREACH);
+		return;
+	}
+
+	fd = -1;
+	error = EHOSTUNREACH;
+	for (p->naddrs = n; p->ai < n; ) {
+		a = &addrs[p->ai++];
+		if ((fd = socket(a->family, a->socktype, a->protocol)) == -1) {
+			error = errno;
+			continue;
+		}
+		if (mark_nonblock(fd) == 0 &&
+		    (connect(fd, (struct sockaddr *)&a->ss, a->len) == 0 ||
+		    errno == EINPROGRESS))
+			break;
+		error = errno;
+		close(fd);
+		fd = -1;
+	}
+
+	if (fd == -1) {
+		peer_fail(p, "connect", error);
+		return;
+	}
+
+	p->fd = fd;
+	p->state = PEER_CONNECTING;
+	worker_event_set(&p->rev, fd, EV_READ | EV_PERSIST, peer_read, p);
+	worker_event_set(&p->wev, fd, EV_WRITE | EV_PERSIST, peer_write, p);
+	event_add(&p->wev, NULL);
+	timer_add(&p->timer, PEER_CONNECTMS);
+}
+
+/* the lookup is usually answered by the cache */
+static void
+peer_connect(struct peer *p)
+{
+	p->state = PEER_RESOLVING;
+	resolv_lookup(p->node->hostname, p->node->portno, peer_resolved, p);
+}
+
+static struct peer *
+peer_get(struct node *n)
+{
+	struct peer *p;
+
+	if (n->peer != NULL)
+		return n->peer;
+
+	if ((p = pool_get(&peerpool)) == NULL)
+		return NULL;
+
+	memset(p, 0, sizeof(*p));
+	p->node = n;
+	p->fd = -1;
+	p->state = PEER_DOWN;
+	timer_set(&p->timer, peer_timeout, p);
+	worker_event_set(&p->linger, -1, 0, peer_lingered, p);
+	LIST_INSERT_HEAD(&peers, p, entry);
+	n->peer = p;
+
+	peer_connect(p);
+	return p;
+}
+
+/* flush the links that got frames in this loop iteration */
+static void
+peer_idle(void)
+{
+	struct peer *p;
+
+	while ((p = LIST_FIRST(&dirty)) != NULL) {
+		LIST_REMOVE(p, dirtyentry);
+		p->dirty = 0;
+		if (p->state == PEER_UP)
+			peer_flush(p);
+	}
+}
+
+/* how many flushes there were in the last second */
+static void
+peer_rate(int fd, short ev, void *d)
+{
+	struct timeval tv = { 1, 0 };
+
+	stats_busy();
+	stats.peer_flushrate = stats.peer_flushes - lastflushes;
+	lastflushes = stats.peer_flushes;
+	evtimer_add(&rate_ev, &tv);
+}
+
+void
+peer_init(void (*fn)(struct wire*))
+{
+	struct timeval tv = { 1, 0 };
+
+	handler = fn;
+	LIST_INIT(&peers);
+	LIST_INIT(&dirty);
+	worker->idle = peer_idle;
+	if (pool_init(&peerpool, "peer", sizeof(struct peer)) == -1 ||
+	    pool_init(&peerbufpool, "peerbuf", sizeof(struct cmdbuf)) == -1)
+		err(1, "pool_init");
+
+	stats.peer_linger = peer_linger;
+	stats.peer_flushbytes = peer_flushbytes;
+	worker_event_set(&rate_ev, -1, 0, peer_rate, NULL);
+	evtimer_add(&rate_ev, &tv);
+}
+
+/*
+ * Queue the frame w for n.  It's written right away only if enough
+ * is queued, otherwise it waits for the frames that follow to be
+ * written together with them.  Returns -1 if the queue is full.
+ */
+int
+peer_send(struct node *n, const struct wire *w)
+{
+	struct peer *p;
+	struct timeval tv;
+
+	if ((p = peer_get(n)) == NULL) {
+		stats.peer_drops++;
+		return -1;
+	}
+
+	if (peer_buf(&p->out) == NULL || wire_encode(p->out, w) == -1) {
+		peer_buf_trim(&p->out);
+		stats.peer_drops++;
+		return -1;
+	}
+	stats.peer_frames++;
+
+	if (p->state != PEER_UP)
+		return 0;
+
+	if (p->out->len - p->out->off >= peer_flushbytes)
+		peer_flush(p);
+	else if (peer_linger == 0) {
+		if (!p->dirty) {
+			LIST_INSERT_HEAD(&dirty, p, dirtyentry);
+			p->dirty = 1;
+		}
+	} else if (!p->lingering) {
+		tv.tv_sec = 0;
+		tv.tv_usec = peer_linger;
+		evtimer_add(&p->linger, &tv);
+		p->lingering = 1;
+	}
+	return 0;
+}
+
+/* how many bytes of frames can be queued for n right now */
+size_t
+peer_room(struct node *n)
+{
+	struct peer *p;
+
+	if ((p = peer_get(n)) == NULL)
+		return 0;
+	if (p->out == NULL)
+		return CMD_BUFSIZE;
+	return sizeof(p->out->data) - (p->out->len - p->out->off);
+}
+
+/*
+ * Whether all the frames queued for n were written, or won't be any
+ * time soon because the link broke.
+ */
+int
+peer_drained(struct node *n)
+{
+	struct peer *p;
+
+	if ((p = n->peer) == NULL || p->out == NULL || p->failures != 0)
+		return 1;
+	return p->out->off == p->out->len;
+}
+
+/*
+ * Forget about the link to n, that is gone for good: no more
+ * reconnects, and the frames still queued are dropped.
+ */
+void
+peer_close(struct node *n)
+{
+	struct peer *p;
+
+	if ((p = n->peer) == NULL)
+		return;
+	n->peer = NULL;
+
+	if (p->state == PEER_UP)
+		stats.peers_up--;
+	if (p->out != NULL && p->out->off != p->out->len)
+		stats.peer_drops++;
+
+	timer_del(&p->timer);
+	if (p->lingering)
+		evtimer_del(&p->linger);
+	if (p->fd != -1) {
+		event_del(&p->rev);
+		event_del(&p->wev);
+		close(p->fd);
+	}
+	if (p->dirty)
+		LIST_REMOVE(p, dirtyentry);
+	LIST_REMOVE(p, entry);
+
+	/*
+	 * the lookup still has it, or we're in peer_read for it: it's
+	 * freed when that's done
+	 */
+	if (p->state == PEER_RESOLVING || p->reading) {
+		p->node = NULL;
+		return;
+	}
+	peer_free(p);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_PEER_H
+#define HIRO_PEER_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <event.h>
+
+#include "cmd.h"
+#include "queue.h"
+#include "wheel.h"
+#include "wire.h"
+
+struct node;
+
+enum peer_state {
+	PEER_DOWN,		/* waiting for the backoff to expire */
+	PEER_RESOLVING,
+	PEER_CONNECTING,
+	PEER_UP,
+};
+
+/*
+ * The frames queued for a link are written together at the end of
+ * the loop iteration, or after PEER_LINGER us if it's not 0, unless
+ * PEER_FLUSHBYTES are queued.  -L and -T change them.
+ */
+#define PEER_LINGER	0
+#define PEER_FLUSHBYTES	(16 * 1024)
+
+/*
+ * A persistent connection to another node, made on the first frame
+ * for it and kept open.  Frames are queued in out while the link is
+ * down and sent once it's up again.  The buffers are only held while
+ * there's something in them.
+ */
+struct peer {
+	struct node		*node;
+	int			 fd;
+	enum peer_state		 state;
+	unsigned int		 failures;	/* in a row */
+	unsigned int		 backoff;	/* ms */
+	int			 partial;	/* frame half written */
+	int			 lingering;	/* linger is pending */
+	int			 dirty;		/* in the dirty list */
+	int			 reading;	/* in the frame handler */
+	size_t			 ai;		/* next address to try */
+	size_t			 naddrs;
+	struct event		 rev;
+	struct event		 wev;
+	struct timer		 timer;		/* backoff or connect */
+	struct event		 linger;
+	struct cmdbuf		*in;
+	struct cmdbuf		*out;
+	LIST_ENTRY(peer)	 entry;
+	LIST_ENTRY(peer)	 dirtyentry;
+};
+
+extern unsigned int	 peer_linger;
+extern size_t		 peer_flushbytes;
+
+void		 peer_init(void (*)(struct wire*));
+int		 peer_send(struct node*, const struct wire*);
+size_t		 peer_room(struct node*);
+int		 peer_drained(struct node*);
+void		 peer_close(struct node*);
+
+#endif
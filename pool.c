@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "pool.h"
+#include "stats.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define POOL_ALIGN	64
+#define POOL_SLABSIZE	(64 * 1024)
+#define POOL_MINOBJS	4
+
+struct poolobj {
+	struct poolobj		*next;
+};
+
+/* the header of every slab, padded to a cache line */
+struct slab {
+	LIST_ENTRY(slab)	 entry;
+	struct poolobj		*free;
+	size_t			 inuse;
+	size_t			 fresh;	/* never handed out yet */
+} __attribute__((aligned(POOL_ALIGN)));
+
+int
+pool_init(struct pool *p, const char *name, size_t size)
+{
+	size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+
+	p->size = size;
+	p->slabsize = POOL_SLABSIZE;
+	while (p->slabsize < sizeof(struct slab) + POOL_MINOBJS * size)
+		p->slabsize *= 2;
+	p->perslab = (p->slabsize - sizeof(struct slab)) / size;
+	LIST_INIT(&p->partial);
+	p->spare = NULL;
+
+	if ((p->stats = stats_pool(name)) == NULL)
+		return -1;
+	p->stats->size = size;
+	return 0;
+}
+
+static struct slab *
+slab_new(struct pool *p)
+{
+	struct slab *s;
+
+	if (posix_memalign((void **)&s, p->slabsize, p->slabsize) != 0)
+		return NULL;
+
+	s->free = NULL;
+	s->inuse = 0;
+	s->fresh = 0;
+	p->stats->slabs++;
+	p->stats->bytes += p->slabsize;
+	return s;
+}
+
+void *
+pool_get(struct pool *p)
+{
+	struct slab *s;
+	struct poolobj *o;
+
+	if ((s = LIST_FIRST(&p->partial)) == NULL) {
+		if ((s = p->spare) != NULL)
+			p->spare = NULL;
+		else if ((s = slab_new(p)) == NULL)
+			return NULL;
+		LIST_INSERT_HEAD(&p->partial, s, entry);
+	}
+
+	/* objects are threaded in the free list only once released */
+	if ((o = s->free) != NULL)
+		s->free = o->next;
+	else
+		o = (struct poolobj *)((char *)(s + 1) + s->fresh++ * p->size);
+
+	if (++s->inuse == p->perslab)
+		LIST_REMOVE(s, entry);
+
+	p->stats->inuse++;
+	return o;
+}
+
+void
+pool_put(struct pool *p, void *ptr)
+{
+	struct slab *s;
+	struct poolobj *o = ptr;
+
+	if (ptr == NULL)
+		return;
+
+	s = (struct slab *)((uintptr_t)ptr & ~(uintptr_t)(p->slabsize - 1));
+	o->next = s->free;
+	s->free = o;
+	p->stats->inuse--;
+
+	if (s->inuse-- == p->perslab)
+		LIST_INSERT_HEAD(&p->partial, s, entry);
+
+	if (s->inuse != 0)
+		return;
+
+	LIST_REMOVE(s, entry);
+	if (p->spare == NULL) {
+		p->spare = s;
+		return;
+	}
+
+	p->stats->slabs--;
+	p->stats->bytes -= p->slabsize;
+	free(s);
+}
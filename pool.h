@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_POOL_H
+#define HIRO_POOL_H
+
+#include <stddef.h>
+
+#include "queue.h"
+
+struct poolstats;
+
+/*
+ * Slab allocator for fixed-size objects.  Objects are rounded up to
+ * a cache line and carved out of slabs aligned to their own size, so
+ * the slab of an object is found by masking its address.  Slabs with
+ * free objects are kept in partial; when a slab becomes empty it's
+ * kept as spare if there's none yet, otherwise it's given back.
+ *
+ * A pool is not thread safe: every worker has its own.
+ */
+struct slab;
+
+struct pool {
+	size_t			 size;		/* of an object */
+	size_t			 slabsize;
+	size_t			 perslab;
+	LIST_HEAD(, slab)	 partial;
+	struct slab		*spare;
+	struct poolstats	*stats;
+};
+
+int		 pool_init(struct pool*, const char*, size_t);
+void		*pool_get(struct pool*);
+void		 pool_put(struct pool*, void*);
+
+#endif
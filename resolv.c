@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "hiro.h"
+#include "log.h"
+#include "resolv.h"
+#include "stats.h"
+#include "util.h"
+
+#include "err.h"
+#include "queue.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * getaddrinfo can block for seconds, so lookups are done by a
+ * thread of their own.  Worker 0 owns the cache: a miss queues the
+ * entry for the resolver thread, which runs getaddrinfo and puts it
+ * on the done queue; worker 0 then stores the answer and calls the
+ * callbacks that were waiting for it.  Failures are cached too, for
+ * a shorter time.
+ */
+
+struct waiter {
+	resolv_cb		 cb;
+	void			*arg;
+	struct waiter		*next;
+};
+
+struct entry {
+	char			*host;
+	char			*port;
+	uint64_t		 expires;	/* ns, 0 if never resolved */
+	int			 pending;
+
+	/* written by the resolver thread while pending */
+	int			 error;
+	struct resolv_addr	 addrs[RESOLV_MAXADDRS];
+	size_t			 naddrs;
+
+	struct waiter		*waiters;
+	LIST_ENTRY(entry)	 entry;
+	TAILQ_ENTRY(entry)	 q;
+};
+
+static LIST_HEAD(, entry)	 cache;
+
+/* the queues between worker 0 and the resolver */
+static pthread_mutex_t		 mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		 cond = PTHREAD_COND_INITIALIZER;
+static TAILQ_HEAD(, entry)	 todo, done;
+static int			 donefd[2];
+static struct event		 doneev;
+
+static void
+resolve(struct entry *e)
+{
+	struct addrinfo hints, *res, *ai;
+	struct resolv_addr *a;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	e->naddrs = 0;
+	if ((e->error = getaddrinfo(e->host, e->port, &hints, &res)) != 0)
+		return;
+
+	for (ai = res; ai != NULL && e->naddrs < RESOLV_MAXADDRS;
+	    ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(a->ss))
+			continue;
+		a = &e->addrs[e->naddrs++];
+		a->family = ai->ai_family;
+		a->socktype = ai->ai_socktype;
+		a->protocol = ai->ai_protocol;
+		a->len = ai->ai_addrlen;
+		memcpy(&a->ss, ai->ai_addr, ai->ai_addrlen);
+	}
+	freeaddrinfo(res);
+}
+
+static void *
+resolver(void *d)
+{
+	struct entry *e;
+	char c = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&mtx);
+		while ((e = TAILQ_FIRST(&todo)) == NULL)
+			pthread_cond_wait(&cond, &mtx);
+		TAILQ_REMOVE(&todo, e, q);
+		pthread_mutex_unlock(&mtx);
+
+		resolve(e);
+
+		pthread_mutex_lock(&mtx);
+		TAILQ_INSERT_TAIL(&done, e, q);
+		pthread_mutex_unlock(&mtx);
+		write(donefd[1], &c, 1);
+	}
+
+	return NULL;
+}
+
+static void
+run_waiters(struct entry *e)
+{
+	struct waiter *w, *next;
+
+	w = e->waiters;
+	e->waiters = NULL;
+	for (; w != NULL; w = next) {
+		next = w->next;
+		w->cb(w->arg, e->error, e->addrs, e->naddrs);
+		free(w);
+	}
+}
+
+static void
+handle_done(int fd, short ev, void *d)
+{
+	struct entry *e;
+	char buf[64];
+
+	stats_busy();
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	for (;;) {
+		pthread_mutex_lock(&mtx);
+		if ((e = TAILQ_FIRST(&done)) != NULL)
+			TAILQ_REMOVE(&done, e, q);
+		pthread_mutex_unlock(&mtx);
+		if (e == NULL)
+			break;
+
+		if (e->error != 0) {
+			stats.resolv_failures++;
+			log_warn("couldn't resolve %s:%s: %s", e->host,
+			    e->port, gai_strerror(e->error));
+		}
+
+		e->pending = 0;
+		e->expires = stats_now() + (uint64_t)1000000000 *
+		    (e->error == 0 ? RESOLV_TTL : RESOLV_NEGTTL);
+		run_waiters(e);
+	}
+}
+
+/* called by worker 0 */
+void
+resolv_init(void)
+{
+	pthread_t t;
+	int r;
+
+	LIST_INIT(&cache);
+	TAILQ_INIT(&todo);
+	TAILQ_INIT(&done);
+
+	if (pipe(donefd) == -1 ||
+	    mark_nonblock(donefd[0]) == -1 ||
+	    mark_nonblock(donefd[1]) == -1)
+		err(1, "resolv_init");
+	worker_event_set(&doneev, donefd[0], EV_READ | EV_PERSIST,
+	    handle_done, NULL);
+	event_add(&doneev, NULL);
+
+	if ((r = pthread_create(&t, NULL, resolver, NULL)) != 0)
+		errx(1, "pthread_create: %s", strerror(r));
+	pthread_detach(t);
+}
+
+static struct entry *
+lookup(const char *host, const char *port)
+{
+	struct entry *e;
+
+	LIST_FOREACH(e, &cache, entry)
+		if (!strcmp(e->host, host) && !strcmp(e->port, port))
+			return e;
+
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		return NULL;
+	if ((e->host = strdup(host)) == NULL ||
+	    (e->port = strdup(port)) == NULL) {
+		free(e->host);
+		free(e);
+		return NULL;
+	}
+	LIST_INSERT_HEAD(&cache, e, entry);
+	return e;
+}
+
+/*
+ * Resolve host:port and call cb with the answer.  A fresh cached
+ * answer is given right away, otherwise cb is called later from the
+ * event loop.
+ */
+void
+resolv_lookup(const char *host, const char *port, resolv_cb cb, void *arg)
+{
+	struct entry *e;
+	struct waiter *w;
+
+	if ((e = lookup(host, port)) == NULL ||
+	    (w = malloc(sizeof(*w))) == NULL) {
+		cb(arg, EAI_MEMORY, NULL, 0);
+		return;
+	}
+
+	if (!e->pending && e->expires > stats_now()) {
+		stats.resolv_hits++;
+		free(w);
+		cb(arg, e->error, e->addrs, e->naddrs);
+		return;
+	}
+
+	w->cb = cb;
+	w->arg = arg;
+	w->next = e->waiters;
+	e->waiters = w;
+
+	if (e->pending)
+		return;
+
+	stats.resolv_misses++;
+	e->pending = 1;
+	pthread_mutex_lock(&mtx);
+	TAILQ_INSERT_TAIL(&todo, e, q);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mtx);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_RESOLV_H
+#define HIRO_RESOLV_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stddef.h>
+
+/* how long answers are cached, in seconds */
+#define RESOLV_TTL	60
+#define RESOLV_NEGTTL	5
+
+#define RESOLV_MAXADDRS	8
+
+struct resolv_addr {
+	int			 family;
+	int			 socktype;
+	int			 protocol;
+	socklen_t		 len;
+	struct sockaddr_storage	 ss;
+};
+
+/*
+ * Called with 0 and the addresses, or with a getaddrinfo error
+ * code.  The addresses are valid only during the call.
+ */
+typedef void (*resolv_cb)(void*, int, const struct resolv_addr*, size_t);
+
+void		 resolv_init(void);
+void		 resolv_lookup(const char*, const char*, resolv_cb, void*);
+
+#endif
@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "can.h"
+#include "route.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Greedy routing: forward towards the neighbor whose zone is the
+ * closest to the target point.  The distance is the L1 distance on
+ * the torus between the point and the nearest point of the zone.
+ * The sum over the axes needs more than 64 bits, so it's kept as a
+ * pair of words: the low one and the carries.
+ */
+
+/* neighbors are scanned in chunks of this many */
+#define ROUTE_CHUNK	64
+
+/*
+ * Distance along an axis from p to [lo, lo + len), without branches
+ * so that the loops over the table can be vectorized.
+ */
+static inline uint64_t
+axis_dist(uint64_t p, uint64_t lo, uint64_t len)
+{
+	uint64_t below, above, d, inside;
+
+	below = lo - p;
+	above = p - (lo + len - 1);
+	d = below < above ? below : above;
+	inside = -(uint64_t)(p - lo <= len - 1);
+	return d & ~inside;
+}
+
+static inline int
+dist_less(uint64_t ahi, uint64_t alo, uint64_t bhi, uint64_t blo)
+{
+	return (ahi < bhi) | ((ahi == bhi) & (alo < blo));
+}
+
+/* distance from p to the closest of our zones */
+void
+route_dist(const struct can *c, const uint64_t *p, uint64_t *hi, uint64_t *lo)
+{
+	uint64_t h, l, d;
+	size_t i;
+	int k;
+
+	*hi = *lo = UINT64_MAX;
+	for (i = 0; i < c->nzones; ++i) {
+		h = l = 0;
+		for (k = 0; k < CAN_DIMS; ++k) {
+			d = axis_dist(p[k], c->zones[i].lo[k],
+			    c->zones[i].len[k]);
+			l += d;
+			h += l < d;
+		}
+		if (dist_less(h, l, *hi, *lo)) {
+			*hi = h;
+			*lo = l;
+		}
+	}
+}
+
+/* distances from p to the n table entries starting at i */
+static inline void
+chunk_dist(const struct can *c, const uint64_t *p, size_t i, size_t n,
+    uint64_t *hi, uint64_t *lo)
+{
+	uint64_t d;
+	size_t j;
+	int k;
+
+	for (j = 0; j < n; ++j)
+		hi[j] = lo[j] = 0;
+	for (k = 0; k < CAN_DIMS; ++k) {
+		for (j = 0; j < n; ++j) {
+			d = axis_dist(p[k], c->nlo[k][i + j],
+			    c->nlen[k][i + j]);
+			lo[j] += d;
+			hi[j] += lo[j] < d;
+		}
+	}
+}
+
+/*
+ * The neighbor to forward a message for p to, or NULL if none is
+ * closer to p than we are: that's the case when we own p.
+ */
+struct node *
+route_next(const struct can *c, const uint64_t *p)
+{
+	uint64_t hi[ROUTE_CHUNK], lo[ROUTE_CHUNK];
+	uint64_t besthi, bestlo;
+	size_t i, j, n, besti;
+	int less;
+
+	route_dist(c, p, &besthi, &bestlo);
+	if (besthi == 0 && bestlo == 0)
+		return NULL;
+
+	besti = c->nneigh;
+	for (i = 0; i < c->nneigh; i += n) {
+		n = c->nneigh - i;
+		if (n > ROUTE_CHUNK)
+			n = ROUTE_CHUNK;
+
+		chunk_dist(c, p, i, n, hi, lo);
+		for (j = 0; j < n; ++j) {
+			less = dist_less(hi[j], lo[j], besthi, bestlo);
+			besti = less ? i + j : besti;
+			besthi = less ? hi[j] : besthi;
+			bestlo = less ? lo[j] : bestlo;
+		}
+	}
+
+	return besti == c->nneigh ? NULL : c->nnode[besti];
+}
+
+/*
+ * Like route_next, but weighing the network cost of the hop: of the
+ * neighbors closer to p than we are, pick the one that makes the
+ * most progress per microsecond of RTT.  The ones not measured yet
+ * count as the slowest measured one; when there are no measurements
+ * at all it's plain greedy.  Every hop still gets closer to p, so
+ * messages can't loop.
+ */
+struct node *
+route_next_rtt(const struct can *c, const uint64_t *p)
+{
+	uint64_t hi[ROUTE_CHUNK], lo[ROUTE_CHUNK];
+	uint64_t selfhi, selflo, besthi, bestlo, h, l;
+	double progress[ROUTE_CHUNK], score, bestscore;
+	uint32_t rtt, maxrtt;
+	size_t i, j, n, besti, bestw;
+	int less;
+
+	route_dist(c, p, &selfhi, &selflo);
+	if (selfhi == 0 && selflo == 0)
+		return NULL;
+
+	/* the slowest of the measured neighbors */
+	maxrtt = 0;
+	for (i = 0; i < c->nneigh; ++i)
+		if (c->nnode[i]->rtt > maxrtt)
+			maxrtt = c->nnode[i]->rtt;
+
+	besthi = selfhi;
+	bestlo = selflo;
+	besti = bestw = c->nneigh;
+	bestscore = 0;
+	for (i = 0; i < c->nneigh; i += n) {
+		n = c->nneigh - i;
+		if (n > ROUTE_CHUNK)
+			n = ROUTE_CHUNK;
+
+		chunk_dist(c, p, i, n, hi, lo);
+		for (j = 0; j < n; ++j) {
+			less = dist_less(hi[j], lo[j], besthi, bestlo);
+			besti = less ? i + j : besti;
+			besthi = less ? hi[j] : besthi;
+			bestlo = less ? lo[j] : bestlo;
+
+			/* how much closer than us, 0 if it's not */
+			less = dist_less(hi[j], lo[j], selfhi, selflo);
+			l = selflo - lo[j];
+			h = selfhi - hi[j] - (selflo < lo[j]);
+			progress[j] = less ? h * 0x1p64 + l : 0;
+		}
+
+		if (maxrtt == 0)
+			continue;
+
+		for (j = 0; j < n; ++j) {
+			if (progress[j] == 0)
+				continue;
+			rtt = c->nnode[i + j]->rtt;
+			score = progress[j] / (rtt != 0 ? rtt : maxrtt);
+			if (score > bestscore) {
+				bestscore = score;
+				bestw = i + j;
+			}
+		}
+	}
+
+	if (bestw != c->nneigh)
+		return c->nnode[bestw];
+	return besti == c->nneigh ? NULL : c->nnode[besti];
+}
+
+/*
+ * Whether a broadcast from o that reached us along axis d, going the
+ * dir way, goes on to the neighbor entry i.  It does along the axes
+ * below d both ways, and along d only the same way; it stops along
+ * an axis once it's half way round the torus from o.  The axis and
+ * the side it's passed along are stored in axis and side.
+ */
+static int
+flood_to(const struct can *c, size_t i, const uint64_t *o, int d, int dir,
+    int *axis, int *side)
+{
+	struct zone z;
+	uint64_t gone;
+	size_t k;
+	int a, s;
+
+	can_neighbor(c, i, &z);
+	for (k = 0; k < c->nzones; ++k) {
+		if ((a = zone_side(&c->zones[k], &z, &s)) == -1)
+			continue;
+		if (a > d || (a == d && s != dir))
+			continue;
+		if (s == 1)
+			gone = z.lo[a] - o[a];
+		else
+			gone = o[a] - (z.lo[a] + z.len[a] - 1);
+		if (gone >= (uint64_t)1 << 63)
+			continue;
+		*axis = a;
+		*side = s;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * CAN-directed flooding: call fn for every neighbor a broadcast from
+ * o that reached us along axis d, going the dir way, is passed on to,
+ * with the axis and the side to tell it.  The origin uses CAN_DIMS
+ * as d so that it sends along every axis.  Every node is called at
+ * most once, for the lowest axis it's reached along.
+ */
+void
+route_flood(const struct can *c, const uint64_t *o, int d, int dir,
+    void (*fn)(struct node*, int, int, void*), void *arg)
+{
+	struct node *n;
+	size_t i, j;
+	int a, s, best, bestside;
+
+	/*
+	 * The zones taken over from others don't line up with the one
+	 * the broadcast got in: send it along every axis from all.
+	 */
+	if (c->nzones > 1)
+		d = CAN_DIMS;
+
+	for (i = 0; i < c->nneigh; ++i) {
+		n = c->nnode[i];
+		for (j = 0; j < i; ++j)
+			if (c->nnode[j] == n)
+				break;
+		if (j != i)
+			continue;
+
+		best = CAN_DIMS;
+		bestside = 0;
+		for (j = i; j < c->nneigh; ++j) {
+			if (c->nnode[j] != n ||
+			    !flood_to(c, j, o, d, dir, &a, &s) || a >= best)
+				continue;
+			best = a;
+			bestside = s;
+		}
+		if (best != CAN_DIMS)
+			fn(n, best, bestside, arg);
+	}
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_ROUTE_H
+#define HIRO_ROUTE_H
+
+#include <stdint.h>
+
+struct can;
+struct node;
+
+/* messages are dropped after this many hops */
+#define ROUTE_MAXHOPS	128
+
+void		 route_dist(const struct can*, const uint64_t*, uint64_t*,
+		    uint64_t*);
+struct node	*route_next(const struct can*, const uint64_t*);
+struct node	*route_next_rtt(const struct can*, const uint64_t*);
+void		 route_flood(const struct can*, const uint64_t*, int, int,
+		    void (*)(struct node*, int, int, void*), void*);
+
+#endif
@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * hiro-sim: grow a CAN overlay of virtual nodes in a single process,
+ * using the same zone, neighbor and routing code as hirod, then make
+ * some of them leave and route random lookups and broadcasts through
+ * what's left.
+ * Links are plain function calls: every frame hirod would send is
+ * counted as a message.
+ */
+
+#include "can.h"
+#include "hist.h"
+#include "route.h"
+
+#include "arc4random.h"
+#include "err.h"
+#include "strtonum.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct vnode {
+	struct node	 node;		/* first, see VNODE */
+	struct can	 can;
+	size_t		 alive;		/* index in alive[] */
+	int		 dead;
+	int		 bcast;		/* last broadcast it got */
+};
+
+#define VNODE(n)	((struct vnode *)(n))
+
+int		 nnodes = 1000;
+int		 nleaves;
+int		 nroutes = 100000;
+int		 nbcasts = 10;
+
+struct vnode	*vnodes;
+struct vnode	**alive;
+size_t		 nalive;
+
+struct hist	 joinhops, joinmsgs, leavemsgs, hops;
+struct hist	 bcastdepth, bcastmsgs, bcastmissed;
+uint64_t	 takeover_fails, route_fails, ttl_drops, hopcalls;
+
+/* a broadcast frame in flight */
+struct flood {
+	struct vnode	*to;
+	int		 axis;
+	int		 side;
+	uint64_t	 depth;
+};
+
+struct flood	*floods;
+size_t		 nfloods, floodalloc;
+
+static void
+usage(const char *me)
+{
+	fprintf(stderr, "USAGE: %s [-b broadcasts] [-l leaves] [-n nodes] "
+	    "[-r routes]\n", me);
+	exit(1);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct vnode *
+random_alive(void)
+{
+	return alive[arc4random_uniform(nalive)];
+}
+
+/*
+ * Walk from v towards the owner of p, counting the hops.  Unlike
+ * hirod there's no ROUTE_MAXHOPS limit, so big overlays can be
+ * measured too; the walks that would have been dropped are counted.
+ */
+static struct vnode *
+route(struct vnode *v, const uint64_t *p, uint64_t *nhops)
+{
+	struct node *n;
+
+	*nhops = 0;
+	while ((n = route_next(&v->can, p)) != NULL) {
+		v = VNODE(n);
+		if (++*nhops > nalive)
+			errx(1, "routing loop");
+	}
+	hopcalls += *nhops + 1;
+	if (*nhops >= ROUTE_MAXHOPS)
+		ttl_drops++;
+	return v;
+}
+
+/* what hirod's announce does: an UPDATE to every neighbor */
+static uint64_t
+announce(struct vnode *v)
+{
+	struct can *c = &v->can;
+	struct node *n;
+	uint64_t msgs = 0;
+	size_t i, j;
+
+	for (i = 0; i < c->nneigh; ++i) {
+		n = c->nnode[i];
+		for (j = 0; j < i; ++j)
+			if (c->nnode[j] == n)
+				break;
+		if (j != i)
+			continue;
+
+		if (can_update(&VNODE(n)->can, &v->node, c->zones,
+		    c->nzones) == -1)
+			err(1, "can_update");
+		msgs++;
+	}
+	return msgs;
+}
+
+static void
+join(struct vnode *v)
+{
+	struct vnode *o;
+	struct zone z, nz;
+	uint64_t p[CAN_DIMS], h, msgs;
+	size_t i;
+
+	random_point(p);
+	o = route(random_alive(), p, &h);
+	hist_add(&joinhops, h);
+	msgs = h + 1;			/* the JOIN, routed */
+
+	if (can_split(&o->can, p, &nz) == -1)
+		errx(1, "can't split a zone");
+
+	/* WELCOME */
+	v->can.zones[0] = nz;
+	v->can.nzones = 1;
+	for (i = 0; i < o->can.nzones; ++i)
+		if (can_add(&v->can, &o->node, &o->can.zones[i]) == -1)
+			err(1, "can_add");
+	for (i = 0; i < o->can.nneigh; ++i) {
+		can_neighbor(&o->can, i, &z);
+		if (can_add(&v->can, o->can.nnode[i], &z) == -1)
+			err(1, "can_add");
+	}
+	msgs++;
+
+	msgs += announce(o);
+	can_prune(&o->can);
+	if (can_update(&o->can, &v->node, &nz, 1) == -1)
+		err(1, "can_update");
+	msgs += announce(v);
+
+	hist_add(&joinmsgs, msgs);
+
+	v->dead = 0;
+	v->alive = nalive;
+	alive[nalive++] = v;
+}
+
+static void
+leave(struct vnode *v)
+{
+	struct vnode *s, *last;
+	struct node *n;
+	struct zone z;
+	uint64_t msgs;
+	size_t i, j;
+
+	if ((n = can_successor(&v->can)) == NULL)
+		return;
+	s = VNODE(n);
+
+	/* the zones and the neighbor table go to the successor */
+	for (i = 0; i < v->can.nzones; ++i)
+		if (can_takeover(&s->can, &v->can.zones[i]) == -1)
+			takeover_fails++;
+	can_remove(&s->can, &v->node);
+	for (i = 0; i < v->can.nneigh; ++i) {
+		can_neighbor(&v->can, i, &z);
+		if (can_add(&s->can, v->can.nnode[i], &z) == -1)
+			err(1, "can_add");
+	}
+	msgs = 1;
+
+	/* everyone else forgets about v */
+	for (i = 0; i < v->can.nneigh; ++i) {
+		n = v->can.nnode[i];
+		for (j = 0; j < i; ++j)
+			if (v->can.nnode[j] == n)
+				break;
+		if (j != i || n == &s->node)
+			continue;
+		can_remove(&VNODE(n)->can, &v->node);
+		msgs++;
+	}
+
+	msgs += announce(s);
+	hist_add(&leavemsgs, msgs);
+
+	v->dead = 1;
+	can_free(&v->can);
+	last = alive[--nalive];
+	alive[v->alive] = last;
+	last->alive = v->alive;
+}
+
+static void
+flood_push(struct node *n, int axis, int side, void *arg)
+{
+	struct flood *f;
+	uint64_t *depth = arg;
+
+	if (nfloods == floodalloc) {
+		floodalloc = floodalloc == 0 ? 1024 : floodalloc * 2;
+		if ((f = reallocarray(floods, floodalloc,
+		    sizeof(*floods))) == NULL)
+			err(1, "reallocarray");
+		floods = f;
+	}
+
+	f = &floods[nfloods++];
+	f->to = VNODE(n);
+	f->axis = axis;
+	f->side = side;
+	f->depth = *depth + 1;
+}
+
+/*
+ * What hirod does for a broadcast from v: every node floods it on
+ * the first time it gets it and drops the copies.  The frames are
+ * handled in the order they're sent, like on links with the same
+ * latency.
+ */
+static void
+broadcast(struct vnode *v, int id)
+{
+	struct flood *f;
+	uint64_t o[CAN_DIMS], depth, maxdepth, msgs, reached;
+	size_t i;
+
+	random_point(o);
+	while (!can_owns(&v->can, o))
+		random_point(o);
+
+	nfloods = 0;
+	depth = maxdepth = 0;
+	v->bcast = id;
+	route_flood(&v->can, o, CAN_DIMS, 0, flood_push, &depth);
+
+	reached = 1;
+	for (i = 0; i < nfloods; ++i) {
+		f = &floods[i];
+		if (f->to->bcast == id)
+			continue;
+		f->to->bcast = id;
+		reached++;
+		if (f->depth > maxdepth)
+			maxdepth = f->depth;
+		depth = f->depth;
+		route_flood(&f->to->can, o, f->axis, f->side, flood_push,
+		    &depth);
+	}
+	msgs = nfloods;
+
+	hist_add(&bcastdepth, maxdepth);
+	hist_add(&bcastmsgs, msgs * 100 / nalive);
+	hist_add(&bcastmissed, nalive - reached);
+}
+
+static void
+report(uint64_t routens)
+{
+	struct hist neigh, entries, zones, vol;
+	struct vnode *v;
+	double ideal, total;
+	size_t i, j, k, distinct, multi;
+
+	memset(&neigh, 0, sizeof(neigh));
+	memset(&entries, 0, sizeof(entries));
+	memset(&zones, 0, sizeof(zones));
+	memset(&vol, 0, sizeof(vol));
+
+	/* the volume every node would have in a perfectly even split */
+	ideal = CAN_DIMS * 64 - log2(nalive);
+
+	multi = 0;
+	for (i = 0; i < nalive; ++i) {
+		v = alive[i];
+
+		distinct = 0;
+		for (j = 0; j < v->can.nneigh; ++j) {
+			for (k = 0; k < j; ++k)
+				if (v->can.nnode[k] == v->can.nnode[j])
+					break;
+			if (k == j)
+				distinct++;
+		}
+		hist_add(&neigh, distinct);
+		hist_add(&entries, v->can.nneigh);
+		hist_add(&zones, v->can.nzones);
+		if (v->can.nzones > 1)
+			multi++;
+
+		/* in hundredths of the ideal volume */
+		total = 0;
+		for (j = 0; j < v->can.nzones; ++j)
+			total += exp2(zone_volume(&v->can.zones[j]) - ideal);
+		hist_add(&vol, total * 100);
+	}
+
+	printf("dimensions:   %d\n", CAN_DIMS);
+	printf("nodes:        %zu (%d joined, %d left)\n", nalive, nnodes,
+	    nleaves);
+	printf("join hops:    mean %.1f  p50 %" PRIu64 "  p99 %" PRIu64
+	    "  max %" PRIu64 "\n", (double)joinhops.sum / joinhops.count,
+	    hist_quantile(&joinhops, .5), hist_quantile(&joinhops, .99),
+	    joinhops.max);
+	printf("join msgs:    mean %.1f  p50 %" PRIu64 "  p99 %" PRIu64
+	    "  max %" PRIu64 "\n", (double)joinmsgs.sum / joinmsgs.count,
+	    hist_quantile(&joinmsgs, .5), hist_quantile(&joinmsgs, .99),
+	    joinmsgs.max);
+	if (leavemsgs.count != 0)
+		printf("leave msgs:   mean %.1f  p50 %" PRIu64 "  p99 %"
+		    PRIu64 "  max %" PRIu64 "\n",
+		    (double)leavemsgs.sum / leavemsgs.count,
+		    hist_quantile(&leavemsgs, .5),
+		    hist_quantile(&leavemsgs, .99), leavemsgs.max);
+	printf("neighbors:    mean %.1f  p50 %" PRIu64 "  p99 %" PRIu64
+	    "  max %" PRIu64 " (table entries mean %.1f, max %" PRIu64 ")\n",
+	    (double)neigh.sum / neigh.count, hist_quantile(&neigh, .5),
+	    hist_quantile(&neigh, .99), neigh.max,
+	    (double)entries.sum / entries.count, entries.max);
+	printf("zones:        %zu nodes with more than one, max %" PRIu64
+	    ", %" PRIu64 " failed takeovers\n", multi, zones.max,
+	    takeover_fails);
+	printf("zone volume:  p1 %.2f  p50 %.2f  p99 %.2f  max %.2f "
+	    "(of the even share)\n", hist_quantile(&vol, .01) / 100.0,
+	    hist_quantile(&vol, .5) / 100.0, hist_quantile(&vol, .99) / 100.0,
+	    vol.max / 100.0);
+	printf("route hops:   mean %.1f  p50 %" PRIu64 "  p99 %" PRIu64
+	    "  max %" PRIu64 " (%d lookups, %" PRIu64 " failed)\n",
+	    (double)hops.sum / hops.count, hist_quantile(&hops, .5),
+	    hist_quantile(&hops, .99), hops.max, nroutes, route_fails);
+	total = hopcalls == 0 ? 0 : (double)routens / hopcalls;
+	printf("next hop:     %.1f ns per call\n", total);
+	printf("over ttl:     %" PRIu64 " lookups took %d hops or more\n",
+	    ttl_drops, ROUTE_MAXHOPS);
+	if (bcastmsgs.count == 0)
+		return;
+	printf("broadcast:    %.2f msgs per node, max %.2f; depth mean %.1f "
+	    "max %" PRIu64 "; %" PRIu64 " nodes missed (%d broadcasts)\n",
+	    (double)bcastmsgs.sum / bcastmsgs.count / 100,
+	    bcastmsgs.max / 100.0, (double)bcastdepth.sum / bcastdepth.count,
+	    bcastdepth.max, bcastmissed.sum, nbcasts);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct vnode *v;
+	uint64_t p[CAN_DIMS], h, start, routens;
+	const char *errstr;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "b:l:n:r:")) != -1) {
+		switch (ch) {
+		case 'b':
+			nbcasts = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "broadcasts are %s: %s", errstr,
+				    optarg);
+			break;
+		case 'l':
+			nleaves = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "leaves are %s: %s", errstr, optarg);
+			break;
+		case 'n':
+			nnodes = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "nodes are %s: %s", errstr, optarg);
+			break;
+		case 'r':
+			nroutes = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "routes are %s: %s", errstr, optarg);
+			break;
+		default:
+			usage(*argv);
+		}
+	}
+	if (argc != optind)
+		usage(*argv);
+	if (nleaves >= nnodes)
+		errx(1, "can't have %d of %d nodes leave", nleaves, nnodes);
+
+	if ((vnodes = calloc(nnodes, sizeof(*vnodes))) == NULL ||
+	    (alive = calloc(nnodes, sizeof(*alive))) == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < nnodes; ++i) {
+		v = &vnodes[i];
+		v->node.id = i;
+		can_init(&v->can, &v->node);
+	}
+
+	can_bootstrap(&vnodes[0].can);
+	alive[nalive++] = &vnodes[0];
+	for (i = 1; i < nnodes; ++i)
+		join(&vnodes[i]);
+
+	for (i = 0; i < nleaves; ++i)
+		leave(random_alive());
+
+	hopcalls = ttl_drops = 0;
+	start = now_ns();
+	for (i = 0; i < nroutes; ++i) {
+		random_point(p);
+		v = route(random_alive(), p, &h);
+		if (!can_owns(&v->can, p))
+			route_fails++;
+		hist_add(&hops, h);
+	}
+	routens = now_ns() - start;
+
+	for (i = 0; i < nbcasts; ++i)
+		broadcast(random_alive(), i + 1);
+
+	report(routens);
+	return 0;
+}
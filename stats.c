@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "stats.h"
+#include "cmd.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+__thread struct stats stats;
+
+uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Called at the start of every event handler: the first one of a
+ * loop iteration marks when the loop woke up.
+ */
+void
+stats_busy(void)
+{
+	if (stats.busy == 0)
+		stats.busy = stats_now();
+}
+
+/* called after every loop iteration */
+void
+stats_idle(void)
+{
+	if (stats.busy == 0)
+		return;
+
+	hist_add(&stats.loop, stats_now() - stats.busy);
+	stats.busy = 0;
+}
+
+/*
+ * The counters for the pool called name.  Every worker creates its
+ * pools in the same order, so they're found at the same index.
+ */
+struct poolstats *
+stats_pool(const char *name)
+{
+	int i;
+
+	for (i = 0; i < STATS_NPOOLS; ++i) {
+		if (stats.pools[i].name == NULL)
+			stats.pools[i].name = name;
+		if (!strcmp(stats.pools[i].name, name))
+			return &stats.pools[i];
+	}
+	return NULL;
+}
+
+struct out {
+	char	*buf;
+	size_t	 len;
+	size_t	 off;
+};
+
+static void
+outf(struct out *o, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	if (o->off >= o->len)
+		return;
+
+	va_start(ap, fmt);
+	r = vsnprintf(o->buf + o->off, o->len - o->off, fmt, ap);
+	va_end(ap);
+
+	if (r > 0)
+		o->off += r;
+}
+
+static void
+outhist(struct out *o, const char *name, const struct hist *h,
+    double scale)
+{
+	outf(o, "%s: count %" PRIu64 " p50 %.1f p99 %.1f p999 %.1f "
+	    "max %.1f\n", name, h->count, hist_quantile(h, .5) / scale,
+	    hist_quantile(h, .99) / scale, hist_quantile(h, .999) / scale,
+	    h->max / scale);
+}
+
+/* add the stats of a worker to the totals in s */
+void
+stats_sum(struct stats *s, const struct stats *w)
+{
+	int i;
+
+	for (i = 0; i < STATS_NCMDS; ++i)
+		s->cmds[i] += w->cmds[i];
+	s->published += w->published;
+	s->fanout += w->fanout;
+	s->dropped += w->dropped;
+	s->bytes_out += w->bytes_out;
+	s->writes += w->writes;
+	s->write_stalls += w->write_stalls;
+	s->ctls += w->ctls;
+	s->clients += w->clients;
+	s->handoffs += w->handoffs;
+	s->handoff_drops += w->handoff_drops;
+	s->spills += w->spills;
+	s->forwarded += w->forwarded;
+	s->route_drops += w->route_drops;
+	s->bcast_sent += w->bcast_sent;
+	s->bcast_recv += w->bcast_recv;
+	s->bcast_dups += w->bcast_dups;
+	s->groups += w->groups;
+	s->mcast_sent += w->mcast_sent;
+	s->mcast_recv += w->mcast_recv;
+	s->mcast_dups += w->mcast_dups;
+	s->timers += w->timers;
+	s->timer_fires += w->timer_fires;
+	s->node_failures += w->node_failures;
+	s->takeovers += w->takeovers;
+	s->ctl_timeouts += w->ctl_timeouts;
+	s->client_timeouts += w->client_timeouts;
+	s->kv_timeouts += w->kv_timeouts;
+	s->peer_timeouts += w->peer_timeouts;
+	s->zones += w->zones;
+	s->neighbors += w->neighbors;
+	s->peers_up += w->peers_up;
+	s->peer_connects += w->peer_connects;
+	s->peer_failures += w->peer_failures;
+	s->peer_drops += w->peer_drops;
+	s->peer_frames += w->peer_frames;
+	s->peer_flushes += w->peer_flushes;
+	s->peer_flushrate += w->peer_flushrate;
+	s->peer_linger += w->peer_linger;
+	s->peer_flushbytes += w->peer_flushbytes;
+	s->resolv_hits += w->resolv_hits;
+	s->resolv_misses += w->resolv_misses;
+	s->resolv_failures += w->resolv_failures;
+	s->kv_keys += w->kv_keys;
+	s->kv_bytes += w->kv_bytes;
+	s->kv_arena += w->kv_arena;
+	s->kv_moved += w->kv_moved;
+	hist_merge(&s->loop, &w->loop);
+	hist_merge(&s->qdepth, &w->qdepth);
+	hist_merge(&s->rtt, &w->rtt);
+
+	for (i = 0; i < STATS_NPOOLS && w->pools[i].name != NULL; ++i) {
+		s->pools[i].name = w->pools[i].name;
+		s->pools[i].size = w->pools[i].size;
+		s->pools[i].inuse += w->pools[i].inuse;
+		s->pools[i].slabs += w->pools[i].slabs;
+		s->pools[i].bytes += w->pools[i].bytes;
+	}
+}
+
+/*
+ * Format the stats of nworkers workers as text in buf.  Returns -1
+ * if buf was too short.
+ */
+int
+stats_print(char *buf, size_t len, const struct stats *s, int nworkers)
+{
+	struct out o = { buf, len, 0 };
+	int i;
+
+	buf[0] = '\0';
+
+	outf(&o, "workers: %d\n", nworkers);
+
+	for (i = 0; i < STATS_NCMDS; ++i) {
+		if (s->cmds[i] != 0)
+			outf(&o, "cmd %s: %" PRIu64 "\n", cmd_name(i),
+			    s->cmds[i]);
+	}
+
+	outf(&o, "ctl connections: %" PRIu64 "\n", s->ctls);
+	outf(&o, "subscribers: %" PRIu64 "\n", s->clients);
+	outf(&o, "published: %" PRIu64 "\n", s->published);
+	outf(&o, "fanout: %" PRIu64 "\n", s->fanout);
+	outf(&o, "dropped: %" PRIu64 "\n", s->dropped);
+	outf(&o, "handoffs: %" PRIu64 "\n", s->handoffs);
+	outf(&o, "handoff drops: %" PRIu64 "\n", s->handoff_drops);
+	outf(&o, "ring spills: %" PRIu64 "\n", s->spills);
+	outf(&o, "zones: %" PRIu64 "\n", s->zones);
+	outf(&o, "neighbors: %" PRIu64 "\n", s->neighbors);
+	outf(&o, "forwarded: %" PRIu64 "\n", s->forwarded);
+	outf(&o, "route drops: %" PRIu64 "\n", s->route_drops);
+	outf(&o, "broadcasts: %" PRIu64 " sent, %" PRIu64 " received, "
+	    "%" PRIu64 " duplicates\n", s->bcast_sent, s->bcast_recv,
+	    s->bcast_dups);
+	outf(&o, "multicast: %" PRIu64 " groups, %" PRIu64 " sent, "
+	    "%" PRIu64 " received, %" PRIu64 " duplicates\n", s->groups,
+	    s->mcast_sent, s->mcast_recv, s->mcast_dups);
+	outf(&o, "neighbor failures: %" PRIu64 ", %" PRIu64 " zones taken "
+	    "over\n", s->node_failures, s->takeovers);
+	outf(&o, "timers: %" PRIu64 " armed, %" PRIu64 " fired\n", s->timers,
+	    s->timer_fires);
+	outf(&o, "timeouts: %" PRIu64 " ctls, %" PRIu64 " clients, %" PRIu64
+	    " requests, %" PRIu64 " connects\n", s->ctl_timeouts,
+	    s->client_timeouts, s->kv_timeouts, s->peer_timeouts);
+	outf(&o, "peers up: %" PRIu64 "\n", s->peers_up);
+	outf(&o, "peer connects: %" PRIu64 "\n", s->peer_connects);
+	outf(&o, "peer failures: %" PRIu64 "\n", s->peer_failures);
+	outf(&o, "peer drops: %" PRIu64 "\n", s->peer_drops);
+	outf(&o, "peer linger: %" PRIu64 " us, or %" PRIu64 " bytes\n",
+	    s->peer_linger, s->peer_flushbytes);
+	outf(&o, "peer flushes: %" PRIu64 ", %" PRIu64 " in the last second, "
+	    "%" PRIu64 " frames\n", s->peer_flushes, s->peer_flushrate,
+	    s->peer_frames);
+	outf(&o, "lookups: %" PRIu64 " cached, %" PRIu64 " resolved, "
+	    "%" PRIu64 " failed\n", s->resolv_hits, s->resolv_misses,
+	    s->resolv_failures);
+	outf(&o, "kv: %" PRIu64 " keys, %" PRIu64 " KB in %" PRIu64
+	    " KB of arena, %" PRIu64 " moved\n", s->kv_keys,
+	    s->kv_bytes / 1024, s->kv_arena / 1024, s->kv_moved);
+	outf(&o, "bytes out: %" PRIu64 "\n", s->bytes_out);
+	outf(&o, "writes: %" PRIu64 "\n", s->writes);
+	outf(&o, "write stalls: %" PRIu64 "\n", s->write_stalls);
+	outhist(&o, "queue depth at enqueue (msgs)", &s->qdepth, 1);
+	outhist(&o, "loop iteration (us)", &s->loop, 1e3);
+	outhist(&o, "neighbor rtt (us)", &s->rtt, 1);
+
+	for (i = 0; i < STATS_NPOOLS && s->pools[i].name != NULL; ++i)
+		outf(&o, "pool %s: %" PRIu64 " x %" PRIu64 " bytes in use, "
+		    "%" PRIu64 " slabs, %" PRIu64 " KB\n", s->pools[i].name,
+		    s->pools[i].inuse, s->pools[i].size, s->pools[i].slabs,
+		    s->pools[i].bytes / 1024);
+
+	/* drop the last newline */
+	if (o.off != 0 && o.off < len)
+		buf[--o.off] = '\0';
+
+	return o.off < len ? 0 : -1;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_STATS_H
+#define HIRO_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hist.h"
+
+#define STATS_NCMDS	32
+#define STATS_NPOOLS	16
+
+/* memory held by an object pool, see pool.c */
+struct poolstats {
+	const char	*name;
+	uint64_t	 size;		/* of an object */
+	uint64_t	 inuse;		/* objects */
+	uint64_t	 slabs;
+	uint64_t	 bytes;		/* in slabs */
+};
+
+/*
+ * Daemon counters.  Every worker has its own copy and is the only
+ * one to update it, so no locking is needed; the other workers only
+ * read them to report the totals, which may thus be a bit stale.
+ */
+struct stats {
+	uint64_t	cmds[STATS_NCMDS];
+	uint64_t	published;	/* messages received by SEND */
+	uint64_t	fanout;		/* messages queued to subscribers */
+	uint64_t	dropped;	/* because of full queues */
+	uint64_t	bytes_out;	/* written to subscribers */
+	uint64_t	writes;
+	uint64_t	write_stalls;	/* short writes and EAGAIN */
+	uint64_t	ctls;		/* open ctl connections */
+	uint64_t	clients;	/* subscribers */
+	uint64_t	handoffs;	/* messages passed to other workers */
+	uint64_t	handoff_drops;	/* out of memory */
+	uint64_t	spills;		/* tasks waiting for a full ring */
+
+	uint64_t	forwarded;	/* overlay messages sent to a neighbor */
+	uint64_t	route_drops;	/* with no route or too many hops */
+	uint64_t	bcast_sent;	/* broadcast frames to neighbors */
+	uint64_t	bcast_recv;	/* broadcasts delivered here */
+	uint64_t	bcast_dups;	/* broadcasts we already had */
+	uint64_t	groups;		/* multicast trees, only on worker 0 */
+	uint64_t	mcast_sent;	/* publishes passed down the trees */
+	uint64_t	mcast_recv;	/* publishes delivered here */
+	uint64_t	mcast_dups;	/* publishes we already had */
+	uint64_t	timers;		/* armed on the wheels */
+	uint64_t	timer_fires;
+	uint64_t	node_failures;	/* neighbors that stopped answering */
+	uint64_t	takeovers;	/* zones of theirs we took over */
+	uint64_t	ctl_timeouts;
+	uint64_t	client_timeouts; /* subscribers that stopped reading */
+	uint64_t	kv_timeouts;	/* requests that got no answer */
+	uint64_t	peer_timeouts;	/* connects that took too long */
+	uint64_t	zones;		/* owned, only on worker 0 */
+	uint64_t	neighbors;	/* entries in the neighbor table */
+	uint64_t	peers_up;	/* links to other nodes */
+	uint64_t	peer_connects;
+	uint64_t	peer_failures;
+	uint64_t	peer_drops;	/* frames lost on the links */
+	uint64_t	peer_frames;	/* queued on the links */
+	uint64_t	peer_flushes;	/* writes on the links */
+	uint64_t	peer_flushrate;	/* flushes in the last second */
+	uint64_t	peer_linger;	/* us, only on worker 0 */
+	uint64_t	peer_flushbytes; /* flush when this much is queued */
+	uint64_t	resolv_hits;	/* lookups answered by the cache */
+	uint64_t	resolv_misses;
+	uint64_t	resolv_failures;
+	uint64_t	kv_keys;	/* stored, only on worker 0 */
+	uint64_t	kv_bytes;	/* of keys and values */
+	uint64_t	kv_arena;	/* bytes allocated for them */
+	uint64_t	kv_moved;	/* keys handed to a new owner */
+
+	uint64_t	busy;		/* when the loop iteration woke up */
+	struct hist	loop;		/* ns spent per loop iteration */
+	struct hist	qdepth;		/* queue length at every enqueue */
+	struct hist	rtt;		/* us, of the probes to neighbors */
+
+	struct poolstats pools[STATS_NPOOLS];
+};
+
+extern __thread struct stats stats;
+
+uint64_t	 stats_now(void);
+void		 stats_busy(void);
+void		 stats_idle(void);
+struct poolstats	*stats_pool(const char*);
+void		 stats_sum(struct stats*, const struct stats*);
+int		 stats_print(char*, size_t, const struct stats*, int);
+
+#endif
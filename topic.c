@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "key.h"
+#include "topic.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TOPICS_MINBUCKETS	64
+
+static inline uint32_t
+topic_hash(const char *s, size_t len)
+{
+	return key_hash(s, len);
+}
+
+int
+topics_init(struct topics *ts)
+{
+	if (pool_init(&ts->subs, "sub", sizeof(struct sub)) == -1)
+		return -1;
+
+	ts->count = 0;
+	ts->nbuckets = TOPICS_MINBUCKETS;
+	ts->buckets = calloc(ts->nbuckets, sizeof(*ts->buckets));
+	return ts->buckets == NULL ? -1 : 0;
+}
+
+/* double the buckets, keeping the old ones if we run out of memory */
+static void
+topics_grow(struct topics *ts)
+{
+	struct topic **b, *t, *next;
+	size_t i, n;
+
+	n = ts->nbuckets * 2;
+	if ((b = calloc(n, sizeof(*b))) == NULL)
+		return;
+
+	for (i = 0; i < ts->nbuckets; ++i) {
+		for (t = ts->buckets[i]; t != NULL; t = next) {
+			next = t->next;
+			t->next = b[t->hash & (n - 1)];
+			b[t->hash & (n - 1)] = t;
+		}
+	}
+
+	free(ts->buckets);
+	ts->buckets = b;
+	ts->nbuckets = n;
+}
+
+static struct topic *
+lookup(struct topics *ts, const char *name, size_t len, uint32_t h)
+{
+	struct topic *t;
+
+	for (t = ts->buckets[h & (ts->nbuckets - 1)]; t != NULL; t = t->next)
+		if (t->hash == h && t->len == len &&
+		    !memcmp(t->name, name, len))
+			return t;
+	return NULL;
+}
+
+struct topic *
+topic_find(struct topics *ts, const char *name, size_t len)
+{
+	return lookup(ts, name, len, topic_hash(name, len));
+}
+
+/*
+ * Add client to the subscribers of the topic, creating it if needed.
+ * The returned sub has to be linked by the caller in the client's
+ * own list.
+ */
+struct sub *
+topic_subscribe(struct topics *ts, const char *name, size_t len,
+    struct client *client)
+{
+	struct topic *t;
+	struct sub *s;
+	uint32_t h;
+
+	if ((s = pool_get(&ts->subs)) == NULL)
+		return NULL;
+
+	h = topic_hash(name, len);
+	if ((t = lookup(ts, name, len, h)) == NULL) {
+		if ((t = calloc(1, sizeof(*t) + len + 1)) == NULL) {
+			pool_put(&ts->subs, s);
+			return NULL;
+		}
+		t->hash = h;
+		t->len = len;
+		memcpy(t->name, name, len);
+		LIST_INIT(&t->subs);
+
+		if (ts->count >= ts->nbuckets)
+			topics_grow(ts);
+		t->next = ts->buckets[h & (ts->nbuckets - 1)];
+		ts->buckets[h & (ts->nbuckets - 1)] = t;
+		ts->count++;
+	}
+
+	s->client = client;
+	s->topic = t;
+	LIST_INSERT_HEAD(&t->subs, s, subs);
+	return s;
+}
+
+/*
+ * Remove the subscription, and the topic if it was the last one.
+ * The sub has to be already unlinked from the client's list.
+ */
+void
+topic_unsubscribe(struct topics *ts, struct sub *s)
+{
+	struct topic *t = s->topic, **tp;
+
+	LIST_REMOVE(s, subs);
+	pool_put(&ts->subs, s);
+
+	if (!LIST_EMPTY(&t->subs))
+		return;
+
+	for (tp = &ts->buckets[t->hash & (ts->nbuckets - 1)]; *tp != t;
+	     tp = &(*tp)->next)
+		;
+	*tp = t->next;
+	ts->count--;
+	free(t);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_TOPIC_H
+#define HIRO_TOPIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+#include "queue.h"
+
+struct client;
+
+/* a client subscribed to a topic */
+struct sub {
+	struct client		*client;
+	struct topic		*topic;
+	LIST_ENTRY(sub)		 subs;		/* of the topic */
+	LIST_ENTRY(sub)		 entry;		/* of the client */
+};
+
+struct topic {
+	struct topic		*next;		/* in the bucket */
+	uint32_t		 hash;
+	size_t			 len;
+	LIST_HEAD(, sub)	 subs;
+	char			 name[];
+};
+
+/* hash table from the topic name to its subscribers */
+struct topics {
+	struct topic		**buckets;
+	size_t			 nbuckets;
+	size_t			 count;
+	struct pool		 subs;
+};
+
+int		 topics_init(struct topics*);
+struct topic	*topic_find(struct topics*, const char*, size_t);
+struct sub	*topic_subscribe(struct topics*, const char*, size_t,
+		    struct client*);
+void		 topic_unsubscribe(struct topics*, struct sub*);
+
+#endif
@@ -20,6 +20,7 @@
 
 #include "strtonum.h"
 
+#include <fcntl.h>
 #include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -48,39 +49,12 @@ parse_portno(const char *p)
 	return n;
 }
 
-struct shstr *
-make_shstr(const char *s)
-{
-	struct shstr *ss;
-	char *dup;
-
-	if ((dup = strdup(s)) == NULL)
-		return NULL;
-
-	if ((ss = calloc(1, sizeof(*ss))) == NULL) {
-		free(dup);
-		return NULL;
-	}
-
-	ss->str = dup;
-	return ss;
-}
-
-struct shstr *
-shstr_inc(struct shstr *s)
-{
-	s->rc++;
-	return s;
-}
-
-void
-free_shstr(struct shstr *s)
+int
+mark_nonblock(int fd)
 {
-	if (s->rc != 0) {
-		s->rc--;
-		return;
-	}
+	int flags;
 
-	free(s->str);
-	free(s);
+	if ((flags = fcntl(fd, F_GETFL)) == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
@@ -19,17 +19,8 @@
 
 #include <stddef.h>
 
-/* string with a reference counter */
-struct shstr {
-	char	*str;
-	size_t	 rc;
-};
-
 const char	*default_socket_path(void);
 int		 parse_portno(const char*);
-
-struct shstr	*make_shstr(const char*);
-struct shstr	*shstr_inc(struct shstr*);
-void		 free_shstr(struct shstr*);
+int		 mark_nonblock(int);
 
 #endif
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "hiro.h"
+#include "stats.h"
+#include "wheel.h"
+
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define TICK_NS		(WHEEL_TICKMS * 1000000ULL)
+
+static inline uint64_t
+tick_now(void)
+{
+	return stats_now() / TICK_NS;
+}
+
+/* put t in its slot, as seen from the next tick to run */
+static void
+place(struct wheel *w, struct timer *t)
+{
+	uint64_t delta, e;
+	int l;
+
+	e = t->expires;
+	delta = e > w->now ? e - w->now : 0;
+	for (l = 0; l < WHEEL_LEVELS - 1; ++l)
+		if (delta >> (WHEEL_BITS * (l + 1)) == 0)
+			break;
+
+	/* beyond the last level: park it as far as it goes */
+	if (delta >> (WHEEL_BITS * WHEEL_LEVELS) != 0)
+		e = w->now + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+	t->level = l;
+	t->slot = (e >> (WHEEL_BITS * l)) & WHEEL_MASK;
+	LIST_INSERT_HEAD(&w->slots[l][t->slot], t, entry);
+	w->used[l] |= 1ULL << t->slot;
+}
+
+static void
+unlink_timer(struct wheel *w, struct timer *t)
+{
+	LIST_REMOVE(t, entry);
+	if (LIST_EMPTY(&w->slots[t->level][t->slot]))
+		w->used[t->level] &= ~(1ULL << t->slot);
+}
+
+/*
+ * Run the tick w->now: the upper slots that start with it are spread
+ * over the levels below first, then the timers of the slot of level
+ * 0 are due.
+ */
+static void
+tick(struct wheel *w)
+{
+	struct timer *t;
+	uint64_t now = w->now;
+	int l, s;
+
+	for (l = 1; l < WHEEL_LEVELS; ++l) {
+		if (((now >> (WHEEL_BITS * (l - 1))) & WHEEL_MASK) != 0)
+			break;
+		s = (now >> (WHEEL_BITS * l)) & WHEEL_MASK;
+		while ((t = LIST_FIRST(&w->slots[l][s])) != NULL) {
+			LIST_REMOVE(t, entry);
+			place(w, t);
+		}
+		w->used[l] &= ~(1ULL << s);
+	}
+
+	s = now & WHEEL_MASK;
+	while ((t = LIST_FIRST(&w->slots[0][s])) != NULL) {
+		LIST_REMOVE(t, entry);
+		t->wheel = NULL;
+		w->count--;
+		stats.timers--;
+		stats.timer_fires++;
+		t->fn(t->arg);
+	}
+	w->used[0] &= ~(1ULL << s);
+	w->now = now + 1;
+}
+
+/* set ev for the next tick that has something to do */
+static void
+schedule(struct wheel *w)
+{
+	struct timeval tv;
+	uint64_t next, used, ns, now;
+	int l, s;
+
+	if (w->count == 0) {
+		if (w->wake != 0)
+			evtimer_del(&w->ev);
+		w->wake = 0;
+		return;
+	}
+
+	/* the upper levels need the next turn of level 0 */
+	next = UINT64_MAX;
+	for (l = 1; l < WHEEL_LEVELS; ++l) {
+		if (w->used[l] != 0) {
+			next = (w->now + WHEEL_MASK) & ~(uint64_t)WHEEL_MASK;
+			break;
+		}
+	}
+
+	if ((used = w->used[0]) != 0) {
+		s = w->now & WHEEL_MASK;
+		if (s != 0)
+			used = used >> s | used << (WHEEL_SLOTS - s);
+		if (w->now + __builtin_ctzll(used) < next)
+			next = w->now + __builtin_ctzll(used);
+	}
+
+	if (w->wake != 0 && w->wake <= next)
+		return;
+	w->wake = next;
+
+	now = stats_now();
+	ns = next * TICK_NS > now ? next * TICK_NS - now : 0;
+	tv.tv_sec = ns / 1000000000;
+	tv.tv_usec = (ns % 1000000000) / 1000;
+	evtimer_add(&w->ev, &tv);
+}
+
+static void
+wheel_run(int fd, short ev, void *d)
+{
+	struct wheel *w = d;
+	uint64_t real;
+
+	stats_busy();
+
+	w->wake = 0;
+	real = tick_now();
+	while (w->now <= real && w->count != 0) {
+		/* nothing to do until the next turn of level 0 */
+		if (w->used[0] == 0 && (w->now & WHEEL_MASK) != 0) {
+			w->now = (w->now | WHEEL_MASK) + 1;
+			if (w->now > real + 1)
+				w->now = real + 1;
+			continue;
+		}
+		tick(w);
+	}
+	if (w->now <= real)
+		w->now = real + 1;
+
+	schedule(w);
+}
+
+/* called by every worker for its own wheel */
+void
+wheel_init(struct wheel *w)
+{
+	int l, s;
+
+	w->now = tick_now();
+	w->wake = 0;
+	w->count = 0;
+	for (l = 0; l < WHEEL_LEVELS; ++l) {
+		w->used[l] = 0;
+		for (s = 0; s < WHEEL_SLOTS; ++s)
+			LIST_INIT(&w->slots[l][s]);
+	}
+	worker_event_set(&w->ev, -1, 0, wheel_run, w);
+}
+
+void
+timer_set(struct timer *t, void (*fn)(void*), void *arg)
+{
+	t->wheel = NULL;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+/*
+ * Run the timer after msec, rounded up to the tick, on the wheel of
+ * the current worker.  A pending timer is moved.
+ */
+void
+timer_add(struct timer *t, unsigned int msec)
+{
+	struct wheel *w = &worker->wheel;
+	uint64_t real, ticks;
+
+	timer_del(t);
+
+	real = tick_now();
+	if (w->count == 0 && w->now < real)
+		w->now = real;
+
+	ticks = (msec + WHEEL_TICKMS - 1) / WHEEL_TICKMS;
+	t->expires = real + (ticks != 0 ? ticks : 1);
+	t->wheel = w;
+	place(w, t);
+	w->count++;
+	stats.timers++;
+
+	schedule(w);
+}
+
+void
+timer_del(struct timer *t)
+{
+	struct wheel *w = t->wheel;
+
+	if (w == NULL)
+		return;
+
+	unlink_timer(w, t);
+	t->wheel = NULL;
+	w->count--;
+	stats.timers--;
+}
+
+int
+timer_pending(const struct timer *t)
+{
+	return t->wheel != NULL;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_WHEEL_H
+#define HIRO_WHEEL_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <event.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "queue.h"
+
+/*
+ * A hierarchical timer wheel: WHEEL_LEVELS wheels of WHEEL_SLOTS
+ * slots each, where a slot of a level spans a whole turn of the one
+ * below.  Adding and removing a timer is O(1), and so is a tick: the
+ * timers of a slot of an upper level are spread over the level below
+ * when the wheel gets there.  With 10ms ticks it reaches 46 hours.
+ */
+#define WHEEL_TICKMS	10
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)	/* as many as bits in a word */
+#define WHEEL_LEVELS	4
+
+struct timer {
+	LIST_ENTRY(timer)	 entry;
+	struct wheel		*wheel;		/* NULL when not pending */
+	uint64_t		 expires;	/* tick */
+	int			 level;
+	int			 slot;
+	void			(*fn)(void*);
+	void			*arg;
+};
+
+LIST_HEAD(timers, timer);
+
+struct wheel {
+	uint64_t		 now;		/* next tick to run */
+	uint64_t		 wake;		/* tick ev is set for, or 0 */
+	uint64_t		 used[WHEEL_LEVELS];	/* non-empty slots */
+	size_t			 count;
+	struct event		 ev;
+	struct timers		 slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void		 wheel_init(struct wheel*);
+void		 timer_set(struct timer*, void (*)(void*), void*);
+void		 timer_add(struct timer*, unsigned int);
+void		 timer_del(struct timer*);
+int		 timer_pending(const struct timer*);
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "wire.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint64_t
+get64(const unsigned char *p)
+{
+	return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+static inline void
+put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline void
+put64(unsigned char *p, uint64_t v)
+{
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+/*
+ * Parse the next frame in buf in place.  Returns 1 and fills w if a
+ * whole frame was available, 0 if more data is needed and -1 if the
+ * frame is malformed.
+ */
+int
+wire_recv(struct cmdbuf *buf, struct wire *w)
+{
+	unsigned char *h;
+	uint32_t len;
+	int k;
+
+	if (buf->len - buf->off < WIRE_HDRLEN)
+		return 0;
+
+	h = (unsigned char *)buf->data + buf->off;
+	len = get32(h + 4);
+	if (h[1] != CAN_DIMS || len > WIRE_MAXLEN)
+		return -1;
+
+	if (buf->len - buf->off < WIRE_HDRLEN + len)
+		return 0;
+
+	/* so that the last string can't run past the body */
+	if (len != 0 && h[WIRE_HDRLEN + len - 1] != '\0')
+		return -1;
+
+	w->type = h[0];
+	w->reality = h[2];
+	w->hops = h[3];
+	w->id = get64(h + 8);
+	for (k = 0; k < CAN_DIMS; ++k)
+		w->point[k] = get64(h + 16 + 8 * k);
+	w->data = (char *)h + WIRE_HDRLEN;
+	w->len = len;
+
+	buf->off += WIRE_HDRLEN + len;
+	return 1;
+}
+
+/*
+ * Append w as a frame to buf.  Returns -1 if it doesn't fit or if
+ * a field is out of the range of the header.
+ */
+int
+wire_encode(struct cmdbuf *buf, const struct wire *w)
+{
+	unsigned char *h;
+	int k;
+
+	if (w->len > WIRE_MAXLEN || (unsigned int)w->type > 0xff ||
+	    (unsigned int)w->reality > 0xff || (unsigned int)w->hops > 0xff)
+		return -1;
+
+	if (sizeof(buf->data) - (buf->len - buf->off) < WIRE_HDRLEN + w->len)
+		return -1;
+
+	if (sizeof(buf->data) - buf->len < WIRE_HDRLEN + w->len) {
+		buf->len -= buf->off;
+		memmove(buf->data, buf->data + buf->off, buf->len);
+		buf->off = 0;
+	}
+
+	h = (unsigned char *)buf->data + buf->len;
+	h[0] = w->type;
+	h[1] = CAN_DIMS;
+	h[2] = w->reality;
+	h[3] = w->hops;
+	put32(h + 4, w->len);
+	put64(h + 8, w->id);
+	for (k = 0; k < CAN_DIMS; ++k)
+		put64(h + 16 + 8 * k, w->point[k]);
+	memcpy(h + WIRE_HDRLEN, w->data, w->len);
+
+	buf->len += WIRE_HDRLEN + w->len;
+	return 0;
+}
+
+/*
+ * Copy a frame parsed by wire_recv together with its body, to keep
+ * it past the next read on its cmdbuf.  Free it with free(3).
+ */
+struct wire *
+wire_dup(const struct wire *w)
+{
+	struct wire *c;
+
+	if ((c = malloc(sizeof(*c) + w->len)) == NULL)
+		return NULL;
+
+	*c = *w;
+	c->data = (char *)(c + 1);
+	memcpy(c->data, w->data, w->len);
+	return c;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HIRO_WIRE_H
+#define HIRO_WIRE_H
+
+#include "can.h"
+#include "cmd.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frames between nodes start with a fixed binary header, in network
+ * byte order:
+ *
+ *	type	1 byte
+ *	dims	1 byte		CAN_DIMS, both ends have to agree
+ *	reality	1 byte
+ *	hops	1 byte
+ *	len	4 bytes		of the body
+ *	id	8 bytes		of the message
+ *	point	8 bytes per dimension, where routed frames go
+ *
+ * The body is a list of NUL-terminated strings.
+ */
+#define WIRE_HDRLEN	(16 + 8 * CAN_DIMS)
+#define WIRE_MAXLEN	(CMD_BUFSIZE - WIRE_HDRLEN)
+
+/*
+ * A decoded frame.  data points inside the cmdbuf the frame was
+ * parsed from, so it's valid only until the next cmdbuf_read on it.
+ */
+struct wire {
+	enum cmd_type	 type;
+	int		 reality;
+	int		 hops;
+	uint64_t	 id;
+	uint64_t	 point[CAN_DIMS];
+	char		*data;
+	size_t		 len;
+};
+
+int		 wire_recv(struct cmdbuf*, struct wire*);
+int		 wire_encode(struct cmdbuf*, const struct wire*);
+struct wire	*wire_dup(const struct wire*);
+
+#endif
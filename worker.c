@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2021 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "hiro.h"
+#include "log.h"
+#include "stats.h"
+#include "util.h"
+
+#include "err.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int		 nworkers;
+struct worker	*workers;
+__thread struct worker *worker;
+
+/* put fn(arg) in r, or return -1 if it's full */
+static int
+ring_put(struct ring *r, void (*fn)(void*), void *arg)
+{
+	struct task *t;
+	size_t tail;
+
+	tail = r->tail;
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_SIZE)
+		return -1;
+
+	t = &r->tasks[tail % RING_SIZE];
+	t->fn = fn;
+	t->arg = arg;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* run everything the other workers handed over to us */
+static void
+drain(struct worker *w)
+{
+	struct ring *r;
+	struct task *t;
+	size_t head, tail;
+	int i;
+
+	for (i = 0; i < nworkers; ++i) {
+		r = &w->inbox[i];
+		head = r->head;
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			t = &r->tasks[head % RING_SIZE];
+			t->fn(t->arg);
+		}
+		__atomic_store_n(&r->head, head, __ATOMIC_SEQ_CST);
+
+		/* there's room for what the producer kept aside */
+		if (__atomic_load_n(&r->spilled, __ATOMIC_SEQ_CST))
+			worker_kick(&workers[i]);
+	}
+}
+
+/* move the tasks we kept aside to the rings that have room now */
+static void
+refill(struct worker *w)
+{
+	struct spills *sp;
+	struct spill *s;
+	struct ring *r;
+	int i, moved;
+
+	for (i = 0; i < nworkers; ++i) {
+		sp = &w->spills[i];
+		if (TAILQ_EMPTY(sp))
+			continue;
+
+		r = &workers[i].inbox[w->id];
+		moved = 0;
+		while ((s = TAILQ_FIRST(sp)) != NULL &&
+		    ring_put(r, s->task.fn, s->task.arg) == 0) {
+			TAILQ_REMOVE(sp, s, entry);
+			free(s);
+			moved = 1;
+		}
+		if (TAILQ_EMPTY(sp))
+			__atomic_store_n(&r->spilled, 0, __ATOMIC_SEQ_CST);
+		if (moved)
+			worker_kick(&workers[i]);
+	}
+}
+
+static void
+handle_wakeup(int fd, short ev, void *d)
+{
+	struct worker *w = d;
+	char buf[64];
+
+	stats_busy();
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	/* posts done after this will kick us again */
+	__atomic_store_n(&w->signalled, 0, __ATOMIC_SEQ_CST);
+	refill(w);
+	drain(w);
+}
+
+/*
+ * Queue fn(arg) to be run by w.  Must be followed by a worker_kick
+ * once all the tasks for w have been posted.  If w's ring is full
+ * the task waits aside until w makes room, so it's never dropped:
+ * returns -1 only if there's no memory for that.
+ */
+int
+worker_post(struct worker *w, void (*fn)(void*), void *arg)
+{
+	struct spills *sp = &worker->spills[w->id];
+	struct spill *s;
+
+	if (TAILQ_EMPTY(sp) && ring_put(&w->inbox[worker->id], fn, arg) == 0)
+		return 0;
+
+	if ((s = malloc(sizeof(*s))) == NULL)
+		return -1;
+	s->task.fn = fn;
+	s->task.arg = arg;
+	TAILQ_INSERT_TAIL(sp, s, entry);
+	__atomic_store_n(&w->inbox[worker->id].spilled, 1, __ATOMIC_SEQ_CST);
+	stats.spills++;
+	return 0;
+}
+
+void
+worker_kick(struct worker *w)
+{
+	char c = 0;
+
+	if (__atomic_exchange_n(&w->signalled, 1, __ATOMIC_SEQ_CST) == 0)
+		write(w->wakeup[1], &c, 1);
+}
+
+/* like event_set, but on the event base of the current worker */
+void
+worker_event_set(struct event *ev, int fd, short events,
+    void (*fn)(int, short, void*), void *arg)
+{
+	event_set(ev, fd, events, fn, arg);
+	event_base_set(worker->base, ev);
+}
+
+static void *
+worker_main(void *d)
+{
+	struct worker *w = d;
+
+	worker = w;
+	w->stats = &stats;
+
+	worker_event_set(&w->wakeev, w->wakeup[0], EV_READ | EV_PERSIST,
+	    handle_wakeup, w);
+	event_add(&w->wakeev, NULL);
+	wheel_init(&w->wheel);
+
+	w->init(w);
+
+	/* like event_dispatch, but keep track of the time spent */
+	while (event_base_loop(w->base, EVLOOP_ONCE) == 0) {
+		if (w->idle != NULL)
+			w->idle();
+		/* in case the ring was drained before we spilled */
+		refill(w);
+		stats_idle();
+	}
+
+	return NULL;
+}
+
+/*
+ * Set up n workers; init is called by every worker in its thread
+ * before entering the event loop.
+ */
+int
+workers_init(int n, void (*init)(struct worker*))
+{
+	struct worker *w;
+	int i, j;
+
+	nworkers = n;
+	if ((workers = calloc(n, sizeof(*workers))) == NULL)
+		return -1;
+
+	for (i = 0; i < n; ++i) {
+		w = &workers[i];
+		w->id = i;
+		w->init = init;
+
+		if ((w->base = event_base_new()) == NULL)
+			return -1;
+		if (posix_memalign((void **)&w->inbox, 64,
+		    n * sizeof(*w->inbox)) != 0)
+			return -1;
+		memset(w->inbox, 0, n * sizeof(*w->inbox));
+		if ((w->spills = calloc(n, sizeof(*w->spills))) == NULL)
+			return -1;
+		for (j = 0; j < n; ++j)
+			TAILQ_INIT(&w->spills[j]);
+		if (pipe(w->wakeup) == -1 ||
+		    mark_nonblock(w->wakeup[0]) == -1 ||
+		    mark_nonblock(w->wakeup[1]) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* start the workers, the first one runs on the calling thread */
+void
+workers_run(void)
+{
+	int i, e;
+
+	for (i = 1; i < nworkers; ++i) {
+		e = pthread_create(&workers[i].thread, NULL, worker_main,
+		    &workers[i]);
+		if (e != 0)
+			errx(1, "pthread_create: %s", strerror(e));
+	}
+
+	workers[0].thread = pthread_self();
+	worker_main(&workers[0]);
+
+	for (i = 1; i < nworkers; ++i)
+		pthread_join(workers[i].thread, NULL);
+}